@@ -23,22 +23,27 @@
 
 #pragma mark --- function prototypes ---
 
-static inline void adjustIPv4Header(mbuf_t m);
-static inline UInt32 adjustIPv6Header(mbuf_t m);
+static inline void adjustIPv4Header(UInt8 *hdr);
+static inline UInt32 adjustIPv6Header(UInt8 *hdr);
+static inline UInt32 copyTsoHeader(mbuf_t m, UInt8 *hdr, bool ipv6);
 
 static inline u32 ether_crc(int length, unsigned char *data);
 
 #pragma mark --- private data ---
 
-static const char *chipNames[] = {
-    "Unkown",
-    "AR8161",
-    "AR8162",
-    "AR8171",
-    "AR8172",
-    "Killer E2200",
-    "Killer E2400",
-    "Killer E2500",
+#define kEEEAdv100     ALX_LOCAL_EEEADV_100BT
+#define kEEEAdv1000    (ALX_LOCAL_EEEADV_100BT | ALX_LOCAL_EEEADV_1000BT)
+
+/* The supported chips only differ in the capabilities below. */
+static const QCAChipInfo chipInfoArray[kNumChips] = {
+    { "Unkown",        0,                  0,             false },
+    { "AR8161",        ALX_DEV_ID_AR8161,  kEEEAdv1000,   true  },
+    { "AR8162",        ALX_DEV_ID_AR8162,  kEEEAdv100,    false },
+    { "AR8171",        ALX_DEV_ID_AR8171,  kEEEAdv1000,   true  },
+    { "AR8172",        ALX_DEV_ID_AR8172,  kEEEAdv100,    false },
+    { "Killer E2200",  ALX_DEV_ID_E2200,   kEEEAdv1000,   true  },
+    { "Killer E2400",  ALX_DEV_ID_E2400,   kEEEAdv1000,   true  },
+    { "Killer E2500",  ALX_DEV_ID_E2500,   kEEEAdv1000,   true  },
 };
 
 static const char *mediumDescriptionArray[MEDIUM_INDEX_COUNT] = {
@@ -97,16 +102,31 @@ bool AtherosE2200::init(OSDictionary *properties)
         mediumDict = NULL;
         txQueue = NULL;
         interruptSource = NULL;
+        rxIntrSource = NULL;
+        txIntrSource = NULL;
+        serviceSource = NULL;
         timerSource = NULL;
+        paceTimerSource = NULL;
         netif = NULL;
         netStats = NULL;
         etherStats = NULL;
         baseMap = NULL;
         baseAddr = NULL;
+        descArenaDesc = NULL;
+        descArenaDmaCmd = NULL;
+        descArena = NULL;
         rxMbufCursor = NULL;
         txMbufCursor = NULL;
         rxBufArrayMem = NULL;
         txBufArrayMem = NULL;
+        numTxDesc = kNumTxDescDef;
+        numRxDesc = kNumRxDescDef;
+        txDescMask = kNumTxDescDef - 1;
+        rxDescMask = kNumRxDescDef - 1;
+        rxBufferSize = rxBufferSizeNew = kRxBufferPktSize;
+        txWakeThreshold = kNumTxDescDef >> kTxQueueWakeShift;
+        txConsumer.queueLimit = kTxQueueLimitMin;
+        txConsumer.queueMinSlack = kTxQueueSlackNone;
         sparePktHead = NULL;
         sparePktTail = NULL;
         spareNum = 0;
@@ -116,8 +136,14 @@ bool AtherosE2200::init(OSDictionary *properties)
         linkUp = false;
         polling = false;
         rxPoll = false;
+        fastResume = false;
+        wakeFromSleep = false;
+        resumeStamp = 0;
+        regShadow.captured = false;
+        regShadow.valid = false;
         useMSI = false;
         chip = kChipUnkown;
+        chipRev = 0;
         eeeCap = 0;
         powerState = 0;
         pciDeviceData.vendor = 0;
@@ -131,8 +157,24 @@ bool AtherosE2200::init(OSDictionary *properties)
         enableTSO4 = false;
         enableTSO6 = false;
         enableCSO6 = false;
+        sleepProxy = false;
+        synWakePort = 0;
+        aspmActive = false;
+        aspmResidency = 0;
+        lpiActive = false;
+        lpiWakeups = 0;
+        rxFifoSize = 0;
+        fcReserveExtra = 0;
+        fcFastPause = false;
+        fcAdjustments = 0;
+        fcQuietPeriods = 0;
+        lpiLatency = 0;
+        aspmEntries = 0;
+        aspmExits = 0;
         flowControl = 0;
         pciPMCtrlOffset = 0;
+        bzero(&rxFrameStats, sizeof(QCAFrameStats));
+        bzero(&txFrameStats, sizeof(QCAFrameStats));
     }
     
 done:
@@ -150,10 +192,26 @@ void AtherosE2200::free()
             workLoop->removeEventSource(interruptSource);
             RELEASE(interruptSource);
         }
+        if (rxIntrSource) {
+            workLoop->removeEventSource(rxIntrSource);
+            RELEASE(rxIntrSource);
+        }
+        if (txIntrSource) {
+            workLoop->removeEventSource(txIntrSource);
+            RELEASE(txIntrSource);
+        }
+        if (serviceSource) {
+            workLoop->removeEventSource(serviceSource);
+            RELEASE(serviceSource);
+        }
         if (timerSource) {
             workLoop->removeEventSource(timerSource);
             RELEASE(timerSource);
         }
+        if (paceTimerSource) {
+            workLoop->removeEventSource(paceTimerSource);
+            RELEASE(paceTimerSource);
+        }
         workLoop->release();
         workLoop = NULL;
     }
@@ -233,9 +291,13 @@ bool AtherosE2200::start(IOService *provider)
     }
     commandGate->retain();
     
+    if (!setupDescArena()) {
+        IOLog("Error allocating descriptor arena.\n");
+        goto error_dma1;
+    }
     if (!setupTxResources()) {
         IOLog("Error allocating Tx resources.\n");
-        goto error_dma1;
+        goto error_dma3;
     }
 
     if (!setupRxResources()) {
@@ -266,6 +328,9 @@ error_src:
 error_dma2:
     freeTxResources();
     
+error_dma3:
+    freeDescArena();
+    
 error_dma1:
     RELEASE(commandGate);
 
@@ -294,10 +359,26 @@ void AtherosE2200::stop(IOService *provider)
             workLoop->removeEventSource(interruptSource);
             RELEASE(interruptSource);
         }
+        if (rxIntrSource) {
+            workLoop->removeEventSource(rxIntrSource);
+            RELEASE(rxIntrSource);
+        }
+        if (txIntrSource) {
+            workLoop->removeEventSource(txIntrSource);
+            RELEASE(txIntrSource);
+        }
+        if (serviceSource) {
+            workLoop->removeEventSource(serviceSource);
+            RELEASE(serviceSource);
+        }
         if (timerSource) {
             workLoop->removeEventSource(timerSource);
             RELEASE(timerSource);
         }
+        if (paceTimerSource) {
+            workLoop->removeEventSource(paceTimerSource);
+            RELEASE(paceTimerSource);
+        }
         workLoop->release();
         workLoop = NULL;
     }
@@ -310,6 +391,7 @@ void AtherosE2200::stop(IOService *provider)
     
     freeRxResources();
     freeTxResources();
+    freeDescArena();
     RELEASE(baseMap);
     baseAddr = NULL;
     
@@ -341,10 +423,21 @@ IOReturn AtherosE2200::setPowerState(unsigned long powerStateOrdinal, IOService
     }
     DebugLog("Switching to power state %lu.\n", powerStateOrdinal);
     
-    if (powerStateOrdinal == kPowerStateOff)
+    if (powerStateOrdinal == kPowerStateOff) {
         commandGate->runAction(setPowerStateSleepAction);
-    else
+        
+        /* Only a shadow captured on the way to sleep may be replayed. */
+        regShadow.valid = regShadow.captured;
+        regShadow.captured = false;
+    } else {
         commandGate->runAction(setPowerStateWakeAction);
+        
+        /* Let enable() take the fast path in case we saved the MAC's state. */
+        if (fastResume && regShadow.valid) {
+            wakeFromSleep = true;
+            clock_get_uptime(&resumeStamp);
+        }
+    }
     
     powerState = powerStateOrdinal;
     
@@ -375,6 +468,7 @@ void AtherosE2200::systemWillShutdown(IOOptionBits specifier)
 IOReturn AtherosE2200::enable(IONetworkInterface *netif)
 {
     IOReturn result = kIOReturnError;
+    bool resumed = false;
     
     DebugLog("enable() ===>\n");
     
@@ -389,18 +483,39 @@ IOReturn AtherosE2200::enable(IONetworkInterface *netif)
     }
     pciDevice->open(this);
     
-    alxEnable();
+    if (wakeFromSleep)
+        resumed = alxResume();
+    else
+        alxEnable();
+    
+    wakeFromSleep = false;
+    regShadow.captured = false;
+    regShadow.valid = false;
     
     /* In case we are using an msi the interrupt hasn't been enabled by start(). */
     if (useMSI)
         interruptSource->enable();
     
-    txDescDoneCount = txDescDoneLast = 0;
+    if (useMSIX) {
+        txIntrSource->enable();
+        rxIntrSource->enable();
+    }
+    serviceSource->enable();
+    
+    txConsumer.descDoneCount = txConsumer.descDoneLast = 0;
     deadlockWarn = 0;
 
     polling = false;
     isEnabled = true;
     
+    /*
+     * In case the PHY kept the link while we were asleep, there
+     * won't be a link change interrupt so that we have to check
+     * the link status on our own.
+     */
+    if (resumed)
+        checkLinkStatus();
+
     result = kIOReturnSuccess;
     
     DebugLog("enable() <===\n");
@@ -424,7 +539,9 @@ IOReturn AtherosE2200::disable(IONetworkInterface *netif)
     polling = false;
 
     timerSource->cancelTimeout();
-    txDescDoneCount = txDescDoneLast = 0;
+    paceTimerSource->cancelTimeout();
+    txShared.paceArmed = 0;
+    txConsumer.descDoneCount = txConsumer.descDoneLast = 0;
     multicastFilter[0] = multicastFilter[1] = 0;
     isEnabled = false;
 
@@ -432,6 +549,22 @@ IOReturn AtherosE2200::disable(IONetworkInterface *netif)
     if (useMSI)
         interruptSource->disable();
     
+    if (useMSIX) {
+        txIntrSource->disable();
+        rxIntrSource->disable();
+    }
+    serviceSource->disable();
+    
+    /*
+     * Save the MAC's state before it gets lost. The interface is still
+     * up when we are disabled for sleep, while an ifconfig down clears
+     * IFF_UP first, so that its state will never be replayed.
+     */
+    if (fastResume && (ifnet_flags(netif->getIfnet()) & IFF_UP))
+        alxSaveRegShadow();
+    else
+        regShadow.captured = false;
+    
     alxDisable();
     clearDescriptors();
     
@@ -447,22 +580,22 @@ done:
 IOReturn AtherosE2200::outputStart(IONetworkInterface *interface, IOOptionBits options )
 {
     IOPhysicalSegment txSegments[kMaxSegs];
+    QCATxPacket txPkt;
     mbuf_t m;
-    QCATxDesc *desc;
     IOReturn result = kIOReturnNoResources;
+    UInt64 probeStamp;
     UInt32 numDescs;
     UInt32 cmd;
     UInt32 totalLen;
     UInt32 mssValue;
-    UInt32 word1;
     UInt32 numSegs;
-    UInt32 lastSeg;
     UInt32 index;
+    UInt32 hdrIndex;
+    UInt32 hdrLen;
+    UInt8 *hdr;
     mbuf_tso_request_flags_t tsoFlags;
     mbuf_csum_request_flags_t checksums;
     UInt16 vlanTag;
-    UInt16 segLen;
-    UInt16 i;
     UInt16 count;
     
     //DebugLog("outputPacket() ===>\n");
@@ -472,8 +605,14 @@ IOReturn AtherosE2200::outputStart(IONetworkInterface *interface, IOOptionBits o
         DebugLog("Interface down. Dropping packets.\n");
         goto done;
     }
-    while ((txNumFreeDesc > (kMaxSegs + 3)) && (interface->dequeueOutputPackets(1, &m, NULL, NULL, NULL) == kIOReturnSuccess)) {
-        numDescs = 0;
+    while ((txShared.numFreeDesc > (kMaxSegs + 3)) && (txShared.bytesInFlight < (SInt32)txConsumer.queueLimit)) {
+        /* Hold packets back while the pacer is out of credit. */
+        if (txPaceRate && (txProducer.paceTokens <= 0) && !txPaceRefill())
+            break;
+        
+        if (interface->dequeueOutputPackets(1, &m, NULL, NULL, NULL) != kIOReturnSuccess)
+            break;
+        
         cmd = 0;
         totalLen = 0;
 
@@ -482,21 +621,61 @@ IOReturn AtherosE2200::outputStart(IONetworkInterface *interface, IOOptionBits o
             freePacket(m);
             continue;
         }
+        /*
+         * Small frames are copied into the slot's bounce buffer, so that
+         * the mbuf can be freed right away without being mapped. They
+         * aren't accounted for in the byte queue limit.
+         */
+        if (txBounceArray && !(tsoFlags & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6)) && ((totalLen = (UInt32)mbuf_pkthdr_len(m)) <= txCopyBreak)) {
+            mbuf_get_csum_requested(m, &checksums, &mssValue);
+            alxGetChkSumCommand(&cmd, checksums);
+            cmd |= (!mbuf_get_vlan_tag(m, &vlanTag)) ? TPD_INS_VLTAG : 0;
+            
+            index = txProducer.nextDescIndex;
+            mbuf_copydata(m, 0, totalLen, txBounceArray + (index * kTxBounceSize));
+            freePacket(m);
+            
+            alxStoreTxDesc(&txDescArray[index], totalLen, vlanTag, (cmd | TPD_EOP), txBouncePhyAddr + (index * kTxBounceSize));
+            txMbufArray[index] = NULL;
+            
+            OSDecrementAtomic(&txShared.numFreeDesc);
+            txProducer.nextDescIndex = (index + 1) & txDescMask;
+            txPaceDebit(&txProducer.paceTokens, totalLen);
+            count++;
+            continue;
+        }
+        hdrIndex = 0;
+        hdrLen = 0;
+        
         /* First prepare the header and the command bits. */
         if (tsoFlags & (MBUF_TSO_IPV4 | MBUF_TSO_IPV6)) {
+            /*
+             * The headers are rewritten in a copy in the slot's bounce
+             * buffer, which is already mapped, so that the packet's data,
+             * which may be shared, stays untouched. Only the payload needs
+             * to be mapped. Fall back to editing in place if the headers
+             * can't be copied.
+             */
+            hdr = (UInt8 *)mbuf_data(m);
+            
+            if (txBounceArray) {
+                hdrIndex = (txProducer.nextDescIndex + ((tsoFlags & MBUF_TSO_IPV6) ? 1 : 0)) & txDescMask;
+                
+                if ((hdrLen = copyTsoHeader(m, txBounceArray + (hdrIndex * kTxBounceSize), (tsoFlags & MBUF_TSO_IPV6))))
+                    hdr = txBounceArray + (hdrIndex * kTxBounceSize);
+            }
             if (tsoFlags & MBUF_TSO_IPV4) {
                 /* Correct the pseudo header checksum. */
-                adjustIPv4Header(m);
+                adjustIPv4Header(hdr);
                 
                 /* Setup the command bits for TSO over IPv4. */
                 cmd = (((mssValue & TPD_MSS_MASK) << TPD_MSS_SHIFT) | TPD_IPV4 | TPD_LSO_EN | kMinL4HdrOffsetV4);
             } else {
                 /* Correct the pseudo header checksum and get the size of the packet including all headers. */
-                totalLen = adjustIPv6Header(m);
+                totalLen = adjustIPv6Header(hdr);
                 
                 /* Setup the command bits for TSO over IPv6. */
                 cmd = (((mssValue & TPD_MSS_MASK) << TPD_MSS_SHIFT) | TPD_LSO_V2 | TPD_LSO_EN | kMinL4HdrOffsetV6);
-                numDescs = 1;
             }
         } else {
             /* We use mssValue as a dummy here because we don't need it anymore. */
@@ -508,58 +687,56 @@ IOReturn AtherosE2200::outputStart(IONetworkInterface *interface, IOOptionBits o
         /* Next get the VLAN tag and command bit. */
         cmd |= (!mbuf_get_vlan_tag(m, &vlanTag)) ? TPD_INS_VLTAG : 0;
         
+        /* Strip the copied headers so that only the payload gets mapped. */
+        if (hdrLen)
+            mbuf_adj(m, hdrLen);
+        
         /* Finally get the physical segments. */
         numSegs = txMbufCursor->getPhysicalSegmentsWithCoalesce(m, &txSegments[0], kMaxSegs);
-        numDescs += numSegs;
         
-        if (!numSegs) {
-            DebugLog("getPhysicalSegmentsWithCoalesce() failed. Dropping packet.\n");
+        txPkt.hdrAddr = txBouncePhyAddr + (hdrIndex * kTxBounceSize);
+        txPkt.hdrLen = hdrLen;
+        txPkt.ctxLen = (tsoFlags & MBUF_TSO_IPV6) ? totalLen : 0;
+        txPkt.cmd = cmd;
+        txPkt.vlanTag = vlanTag;
+        
+        /* The context descriptor, the headers and the payload, in this order. */
+        if (!numSegs || !(numDescs = txEmitPacket<QCAHostOrder>((volatile UInt64 *)txDescArray, txMbufArray, txDescMask, txProducer.nextDescIndex, &txPkt, txSegments, numSegs, m, TPD_EOP, &index))) {
+            DebugLog("No payload segments. Dropping packet.\n");
             etherStats->dot3TxExtraEntry.resourceErrors++;
             freePacket(m);
             continue;
         }
-        OSAddAtomic(-numDescs, &txNumFreeDesc);
-        index = txNextDescIndex;
-        txNextDescIndex = (txNextDescIndex + numDescs) & kTxDescMask;
-        lastSeg = numSegs - 1;
-        
-        /* Setup the context descriptor for TSO over IPv6. */
-        if (tsoFlags & MBUF_TSO_IPV6) {
-            desc = &txDescArray[index];
-            
-            desc->vlanTag = OSSwapHostToBigInt16(vlanTag);
-            desc->word1 = OSSwapHostToLittleInt32(cmd);
-            desc->adrl.l.pktLength = OSSwapHostToLittleInt32(totalLen);
-            
-            ++index &= kTxDescMask;
-        }
-        /* And finally fill in the data descriptors. */
-        for (i = 0; i < numSegs; i++) {
-            desc = &txDescArray[index];
-            word1 = cmd;
-            segLen = (UInt16)txSegments[i].length;
-            
-            if (i == lastSeg) {
-                word1 |= TPD_EOP;
-                txMbufArray[index] = m;
-            } else {
-                txMbufArray[index] = NULL;
-            }
-            desc->vlanTag = OSSwapHostToBigInt16(vlanTag);
-            desc->length = OSSwapHostToLittleInt16(segLen);
-            desc->word1 = OSSwapHostToLittleInt32(word1);
-            desc->adrl.addr = OSSwapHostToLittleInt64(txSegments[i].location);
+        OSAddAtomic(-numDescs, &txShared.numFreeDesc);
+        OSAddAtomic((SInt32)mbuf_pkthdr_len(m), &txShared.bytesInFlight);
+        txPaceDebit(&txProducer.paceTokens, (UInt32)mbuf_pkthdr_len(m) + hdrLen);
+        txProducer.nextDescIndex = (txProducer.nextDescIndex + numDescs) & txDescMask;
+        
+        /* Sample the time in flight of one packet at a time. */
+        if (!txShared.probeStamp) {
+            txShared.probeIndex = index;
+            clock_get_uptime(&probeStamp);
             
-            ++index &= kTxDescMask;
+            /* The work loop must see the index before the stamp. */
+            OSMemoryBarrier();
+            txShared.probeStamp = probeStamp;
         }
         count++;
     }
     if (count) {
         /* flush updates before updating hardware */
-        OSSynchronizeIO();
-        alxWriteMem16(ALX_TPD_PRI0_PIDX, txNextDescIndex);
+        alxDescBarrier();
+        alxWriteMem16(ALX_TPD_PRI0_PIDX, txProducer.nextDescIndex);
+    }
+    if (txShared.bytesInFlight >= (SInt32)txConsumer.queueLimit) {
+        /* The flag is cleared by txQueueCompleted() on the work loop. */
+        OSCompareAndSwap(0, 1, &txShared.queueLimited);
+        result = kIOReturnNoResources;
+    } else if (txShared.paceArmed) {
+        result = kIOReturnNoResources;
+    } else {
+        result = (txShared.numFreeDesc > (kMaxSegs + 3)) ? kIOReturnSuccess : kIOReturnNoResources;
     }
-    result = (txNumFreeDesc > (kMaxSegs + 3)) ? kIOReturnSuccess : kIOReturnNoResources;
 
 done:
     //DebugLog("outputStart() <===\n");
@@ -607,7 +784,7 @@ const OSString* AtherosE2200::newModelString() const
     DebugLog("newModelString() ===>\n");
     DebugLog("newModelString() <===\n");
     
-    return OSString::withCString(chipNames[chip]);
+    return OSString::withCString(chipInfoArray[chip].name);
 }
 
 bool AtherosE2200::configureInterface(IONetworkInterface *interface)
@@ -657,7 +834,7 @@ bool AtherosE2200::configureInterface(IONetworkInterface *interface)
         goto done;
     }
     if (rxPoll) {
-        error = interface->configureInputPacketPolling(kNumRxDesc, kIONetworkWorkLoopSynchronous);
+        error = interface->configureInputPacketPolling(numRxDesc, kIONetworkWorkLoopSynchronous);
         
         if (error != kIOReturnSuccess) {
             IOLog("configureInputPacketPolling() failed\n.");
@@ -666,10 +843,10 @@ bool AtherosE2200::configureInterface(IONetworkInterface *interface)
         }
     }
 
-    if ((chip == kChipAR8162) || (chip == kChipAR8172))
-        snprintf(modelName, kNameLenght, "Qualcomm Atheros %s PCIe Fast Ethernet", chipNames[chip]);
+    if (gbCapable)
+        snprintf(modelName, kNameLenght, "Qualcomm Atheros %s PCIe Gigabit Ethernet", chipInfoArray[chip].name);
     else
-        snprintf(modelName, kNameLenght, "Qualcomm Atheros %s PCIe Gigabit Ethernet", chipNames[chip]);
+        snprintf(modelName, kNameLenght, "Qualcomm Atheros %s PCIe Fast Ethernet", chipInfoArray[chip].name);
     
     setProperty("model", modelName);
     
@@ -943,6 +1120,9 @@ IOReturn AtherosE2200::setMaxPacketSize(UInt32 maxSize)
     if (maxSize <= kMaxPacketSize) {
         hw.mtu = maxSize - (ETH_HLEN + ETH_FCS_LEN);
         
+        /* Use page sized buffers for jumbo frames, switched by setLinkDown(). */
+        rxBufferSizeNew = rxBufferSizeFor(maxSize);
+
         DebugLog("maxSize: %u, mtu: %u\n", maxSize, hw.mtu);
 
         if(enableTSO4)
@@ -999,15 +1179,28 @@ IOReturn AtherosE2200::setInputPacketPollingEnable(IONetworkInterface *interface
 
 void AtherosE2200::pollInputPackets(IONetworkInterface *interface, uint32_t maxCount, IOMbufQueue *pollQueue, void *context )
 {
+    UInt32 packets;
+    
     //DebugLog("pollInputPackets() ===>\n");
     
     if (polling) {
-        rxInterrupt(interface, maxCount, pollQueue, context);
+        packets = rxInterrupt(interface, maxCount, pollQueue, context);
+        
+        /* Collect the batch occupancy for the poll controller. */
+        pollStats.polls++;
+        
+        if (!packets)
+            pollStats.emptyPolls++;
+        else if (packets >= maxCount)
+            pollStats.fullPolls++;
+        
+        if (aspmActive && (packets >= kAspmBurstPackets))
+            aspmExit();
     
         /* Finally cleanup the transmitter ring. */
-        txInterrupt();
+        txInterrupt(numTxDesc);
         
-        if (spareNum < kRxNumSpareMbufs)
+        if ((spareNum < kRxNumSpareMbufs) || (rxFillCount < numRxDesc))
             commandGate->runAction(refillAction);
     }
     //DebugLog("pollInputPackets() <===\n");
@@ -1016,30 +1209,136 @@ void AtherosE2200::pollInputPackets(IONetworkInterface *interface, uint32_t maxC
 
 #pragma mark --- common interrupt methods ---
 
-void AtherosE2200::txInterrupt()
+/* AtherosE2200::txInterrupt()
+ *
+ * Reclaim at most budget completed tx descriptors. Returns true in case
+ * there are completed descriptors left.
+ */
+
+bool AtherosE2200::txInterrupt(UInt32 budget)
 {
+    UInt64 now, delta, probeStamp;
+    UInt32 bytes = 0;
     UInt16 newDirtyIndex = alxReadMem16(ALX_TPD_PRI0_CIDX);
     
-    //DebugLog("txInterrupt oldIndex=%u newIndex=%u\n", txDirtyDescIndex, newDirtyIndex);
+    //DebugLog("txInterrupt oldIndex=%u newIndex=%u\n", txConsumer.dirtyDescIndex, newDirtyIndex);
 
-    if (txDirtyDescIndex != newDirtyIndex) {
-        while (txDirtyDescIndex != newDirtyIndex) {
-            if (txMbufArray[txDirtyDescIndex]) {
-                freePacket(txMbufArray[txDirtyDescIndex], kDelayFree);
-                txMbufArray[txDirtyDescIndex] = NULL;
+    if (txConsumer.dirtyDescIndex != newDirtyIndex) {
+        while ((txConsumer.dirtyDescIndex != newDirtyIndex) && budget) {
+            if (txMbufArray[txConsumer.dirtyDescIndex]) {
+                bytes += (UInt32)mbuf_pkthdr_len(txMbufArray[txConsumer.dirtyDescIndex]);
+                freePacket(txMbufArray[txConsumer.dirtyDescIndex], kDelayFree);
+                txMbufArray[txConsumer.dirtyDescIndex] = NULL;
+                
+                /* Pairs with the barrier in outputStart(). */
+                if ((probeStamp = txShared.probeStamp)) {
+                    OSMemoryBarrier();
+                    
+                    if (txConsumer.dirtyDescIndex == txShared.probeIndex) {
+                        clock_get_uptime(&now);
+                        absolutetime_to_nanoseconds(now - probeStamp, &delta);
+                        txConsumer.timeInFlight = (3 * txConsumer.timeInFlight + (UInt32)(delta / 1000)) >> 2;
+                        txShared.probeStamp = 0;
+                    }
+                }
             }
-            txDescDoneCount++;
-            OSIncrementAtomic(&txNumFreeDesc);
-            ++txDirtyDescIndex &= kTxDescMask;
+            txConsumer.descDoneCount++;
+            OSIncrementAtomic(&txShared.numFreeDesc);
+            ++txConsumer.dirtyDescIndex &= txDescMask;
+            budget--;
         }
         releaseFreePackets();
+        txQueueCompleted(bytes);
         
-        if (txNumFreeDesc > kTxQueueWakeTreshhold)
+        if ((txShared.numFreeDesc > txWakeThreshold) && (txShared.bytesInFlight < (SInt32)txConsumer.queueLimit))
             netif->signalOutputThread();
         
         if (!polling)
             etherStats->dot3TxExtraEntry.interrupts++;
     }
+    return (txConsumer.dirtyDescIndex != newDirtyIndex);
+}
+
+/* AtherosE2200::txQueueCompleted()
+ *
+ * Account for completed tx bytes. When the hardware ran dry while
+ * outputStart() held packets back, the limit was too small and is raised.
+ * Otherwise remember the smallest slack seen, so that txQueueAdjustLimit()
+ * can give back what wasn't needed.
+ */
+
+void AtherosE2200::txQueueCompleted(UInt32 bytes)
+{
+    SInt32 inFlight = OSAddAtomic(-(SInt32)bytes, &txShared.bytesInFlight) - (SInt32)bytes;
+    UInt32 slack;
+    
+    if ((inFlight <= 0) && OSCompareAndSwap(1, 0, &txShared.queueLimited)) {
+        txConsumer.queueLimit += (txConsumer.queueLimit >> 1);
+        
+        if (txConsumer.queueLimit > kTxQueueLimitMax)
+            txConsumer.queueLimit = kTxQueueLimitMax;
+        
+        txConsumer.queueMinSlack = kTxQueueSlackNone;
+    } else {
+        slack = (inFlight < (SInt32)txConsumer.queueLimit) ? (txConsumer.queueLimit - inFlight) : 0;
+        
+        if (slack < txConsumer.queueMinSlack)
+            txConsumer.queueMinSlack = slack;
+    }
+}
+
+void AtherosE2200::txQueueAdjustLimit()
+{
+    if (txConsumer.queueMinSlack != kTxQueueSlackNone) {
+        txConsumer.queueLimit -= (txConsumer.queueMinSlack >> 1);
+        
+        if (txConsumer.queueLimit < kTxQueueLimitMin)
+            txConsumer.queueLimit = kTxQueueLimitMin;
+        
+        txConsumer.queueMinSlack = kTxQueueSlackNone;
+    }
+    setProperty(kTxQueueLimitName, txConsumer.queueLimit, 32);
+    setProperty(kTxTimeInFlightName, txConsumer.timeInFlight, 32);
+}
+
+/* AtherosE2200::txPaceRefill()
+ *
+ * Credit the tx pacer for the time elapsed since the last refill, limited
+ * to one burst. In case the credit is still exhausted, arm the pacing timer
+ * for the time it takes to pay back the debt and return false. txPaceRate
+ * is given in Mbit/s, i.e. bits per microsecond.
+ */
+
+bool AtherosE2200::txPaceRefill()
+{
+    UInt64 now, delta;
+    UInt32 us;
+    
+    if (txShared.paceArmed)
+        return false;
+    
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - txProducer.paceStamp, &delta);
+    txProducer.paceStamp = now;
+    
+    if (txPaceCredit(&txProducer.paceTokens, delta, txPaceRate))
+        return true;
+    
+    us = txPaceDelay(txProducer.paceTokens, txPaceRate);
+    
+    /* The flag is shared with txPaceAction() on the work loop. */
+    if (OSCompareAndSwap(0, 1, &txShared.paceArmed))
+        paceTimerSource->setTimeoutUS(us);
+    
+    return false;
+}
+
+void AtherosE2200::txPaceAction(IOTimerEventSource *timer)
+{
+    OSCompareAndSwap(1, 0, &txShared.paceArmed);
+    
+    if (isEnabled && linkUp)
+        netif->signalOutputThread();
 }
 
 UInt32 AtherosE2200::rxInterrupt(IONetworkInterface *interface, uint32_t maxCount, IOMbufQueue *pollQueue, void *context)
@@ -1048,6 +1347,7 @@ UInt32 AtherosE2200::rxInterrupt(IONetworkInterface *interface, uint32_t maxCoun
     QCARxRetDesc *desc = &rxRetDescArray[rxNextDescIndex];
     mbuf_t bufPkt, newPkt;
     mbuf_t extraPkt, tailPkt;
+    UInt64 status;
     UInt32 status0, status2, status3;
     UInt32 pktSize;
     UInt32 validMask;
@@ -1061,16 +1361,20 @@ UInt32 AtherosE2200::rxInterrupt(IONetworkInterface *interface, uint32_t maxCoun
     
     //DebugLog("rxInterrupt()\n");
     
-    while (((status3 = OSSwapLittleToHostInt32(desc->word3)) & RRD_UPDATED) && (goodPkts < maxCount)) {
-        status0 = OSSwapLittleToHostInt32(desc->word0);
-        status2 = OSSwapLittleToHostInt32(desc->word2);
+    while (((status = alxLoadRxDesc(desc, 1)) & ((UInt64)RRD_UPDATED << 32)) && (goodPkts < maxCount)) {
+        /* Don't read the other words before the descriptor is ours. */
+        alxDescBarrier();
+        
+        status0 = (UInt32)alxLoadRxDesc(desc, 0);
+        status2 = (UInt32)status;
+        status3 = (UInt32)(status >> 32);
         pktSize = (status3 & RRD_PKTLEN_MASK) - kIOEthernetCRCSize;
         extraBufs = (((status0 >> RRD_NOR_SHIFT) & 0x000F) - 1);
         index = (status0 >> RRD_SI_SHIFT) & RRD_SI_MASK;
-        lastIndex = (index + extraBufs) & kRxDescMask;
+        lastIndex = (index + extraBufs) & rxDescMask;
         vlanTag = (status3 & RRD_VLTAGGED) ? OSSwapBigToHostInt16(status2 & RRD_VLTAG_MASK) : 0;
         bufPkt = rxMbufArray[index];
-        extraSize = pktSize - kRxBufferPktSize;
+        extraSize = pktSize - rxBufferSize;
 
         //DebugLog("Packet with index=%u, numBufs=%u, pktSize=%u, errors=0x%x\n", index, numBufs, pktSize, errors);
         
@@ -1122,9 +1426,9 @@ handle_pkt:
             rxFreeDescArray[index].addr = OSSwapHostToLittleInt64(rxSegment.location);
         }
         while (extraSize > 0) {
-            ++index &= kRxDescMask;
+            ++index &= rxDescMask;
             bufPkt = rxMbufArray[index];
-            extraPkt = replacePacket(&bufPkt, kRxBufferPktSize);
+            extraPkt = replacePacket(&bufPkt, rxBufferSize);
             
             if (!extraPkt) {
                 /* Allocation of a new packet failed so that we must leave the original packet in place. */
@@ -1134,7 +1438,7 @@ handle_pkt:
                 goto nextDesc;
             }
             mbuf_setflags_mask(extraPkt, 0, MBUF_PKTHDR);
-            mbuf_setlen(extraPkt, (extraSize > kRxBufferPktSize) ? kRxBufferPktSize : extraSize);
+            mbuf_setlen(extraPkt, (extraSize > (SInt32)rxBufferSize) ? rxBufferSize : extraSize);
             mbuf_setnext(tailPkt, extraPkt);
             
             n = rxMbufCursor->getPhysicalSegments(bufPkt, &rxSegment, 1);
@@ -1148,7 +1452,7 @@ handle_pkt:
             rxMbufArray[index] = bufPkt;
             rxFreeDescArray[index].addr = OSSwapHostToLittleInt64(rxSegment.location);
             
-            extraSize -= kRxBufferPktSize;
+            extraSize -= rxBufferSize;
             tailPkt = extraPkt;
         }
         switch (getProtocolID(status2)) {
@@ -1183,7 +1487,7 @@ handle_pkt:
             setVlanTag(newPkt, vlanTag);
         
         mbuf_pkthdr_setlen(newPkt, pktSize);
-        mbuf_setlen(newPkt, (pktSize > kRxBufferPktSize) ? kRxBufferPktSize : pktSize);
+        mbuf_setlen(newPkt, (pktSize > rxBufferSize) ? rxBufferSize : pktSize);
         interface->enqueueInputPacket(newPkt, pollQueue);
         goodPkts++;
         
@@ -1191,11 +1495,19 @@ handle_pkt:
     nextDesc:
         desc->word3 = OSSwapHostToLittleInt32(status3 & ~RRD_UPDATED);
         
-        ++rxNextDescIndex &= kRxDescMask;
+        ++rxNextDescIndex &= rxDescMask;
         desc = &rxRetDescArray[rxNextDescIndex];
         
-        alxWriteMem16(ALX_RFD_PIDX, lastIndex);
+        /* Make the refilled free descriptors visible before handing them back. */
+        alxDescBarrier();
+        
+        /* While the ring is still being populated growRxRing() owns the producer index. */
+        if (rxFillCount == numRxDesc)
+            alxWriteMem16(ALX_RFD_PIDX, lastIndex);
     }
+    if (resumeStamp && goodPkts)
+        reportResumeLatency();
+    
     return goodPkts;
 }
 
@@ -1223,7 +1535,10 @@ void AtherosE2200::checkLinkStatus()
 void AtherosE2200::interruptOccurred(OSObject *client, IOInterruptEventSource *src, int count)
 {
 	UInt32 status = alxReadMem32(ALX_ISR);
-    UInt32 packets;
+    
+    /* With MSI-X the queue causes have vectors of their own. */
+    if (useMSIX)
+        status &= ~kQueueIntrMask;
     
     /* hotplug/major error/no more work/shared irq */
 	if (status & ALX_ISR_DIS || !(status & intrMask))
@@ -1241,19 +1556,10 @@ void AtherosE2200::interruptOccurred(OSObject *client, IOInterruptEventSource *s
 	if (status & ALX_ISR_ALERT)
         IOLog("Alert interrupt. ISR=0x%x\n", status);
 
-    if (!polling) {
-        if (status & ALX_ISR_TX_Q0)
-            txInterrupt();
-        
-        if (status & ALX_ISR_RX_Q0) {
-            packets = rxInterrupt(netif, kNumRxDesc, NULL, NULL);
-            
-            if (packets)
-                netif->flushInputQueue();
-            
-            if (spareNum < kRxNumSpareMbufs)
-                refillSpareBuffers();
-        }
+    /* Keep the queue interrupts masked until both directions are idle. */
+    if (!polling && (status & kQueueIntrMask)) {
+        alxWriteMem32(ALX_IMR, intrMask & ~kQueueIntrMask);
+        serviceQueues();
     }
 	if (status & ALX_ISR_PHY)
         checkLinkStatus();
@@ -1262,18 +1568,164 @@ done:
     alxWriteMem32(ALX_ISR, 0);
 }
 
+/* AtherosE2200::serviceQueues()
+ *
+ * Do one pass over both rings, each limited by its budget, tx first.
+ * In case a budget was exhausted, reschedule through serviceSource so
+ * that link and error events get a chance to run in between. Otherwise
+ * both rings are idle and the queue interrupts are unmasked again.
+ */
+
+void AtherosE2200::serviceQueues()
+{
+    UInt32 packets;
+    bool more;
+    
+    more = txInterrupt(txBudget);
+    packets = rxInterrupt(netif, rxBudget, NULL, NULL);
+    
+    if (aspmActive && (packets >= kAspmBurstPackets))
+        aspmExit();
+    
+    if (packets) {
+        lpiBursts++;
+        netif->flushInputQueue();
+        
+        if (packets >= rxBudget)
+            more = true;
+    }
+    if (rxFillCount < numRxDesc)
+        growRxRing(kRxFillStep);
+    
+    if (spareNum < kRxNumSpareMbufs)
+        refillSpareBuffers();
+    
+    /* Rather spin a little while than wait for the next interrupt. */
+    if (!more && busyPollTime)
+        more = busyPoll();
+    
+    if (more)
+        serviceSource->interruptOccurred(0, 0, 0);
+    else
+        alxWriteMem32(ALX_IMR, intrMask);
+}
+
+/* AtherosE2200::busyPoll()
+ *
+ * Spin on RRD_UPDATED of the next rx return descriptor for up to
+ * busyPollCur microseconds. Returns true in case a packet arrived.
+ * Called from serviceQueues() and, with MSI-X, from rxVectorOccurred().
+ * The spin runs on the work loop before rx interrupts are re-enabled,
+ * so that tx completion, timers and link events are delayed by up to
+ * kBusyPollMaxUS each time.
+ */
+
+bool AtherosE2200::busyPoll()
+{
+    UInt64 start, now, deadline, delta;
+    bool hit = false;
+    
+    if (!busyPollCur || (busyPollSpent >= kBusyPollBudgetUS))
+        return false;
+    
+    clock_get_uptime(&start);
+    nanoseconds_to_absolutetime(busyPollCur * 1000ULL, &deadline);
+    deadline += start;
+    
+    do {
+        clock_get_uptime(&now);
+
+        if (alxLoadRxDesc(&rxRetDescArray[rxNextDescIndex], 1) & ((UInt64)RRD_UPDATED << 32)) {
+            hit = true;
+            break;
+        }
+    } while (now < deadline);
+    
+    absolutetime_to_nanoseconds(now - start, &delta);
+    busyPollSpent += (UInt32)(delta / 1000);
+    
+    if (hit) {
+        busyPollHits++;
+        busyPollMissRun = 0;
+        busyPollCur = busyPollTime;
+    } else {
+        busyPollMisses++;
+        
+        if (++busyPollMissRun >= kBusyPollBackoff) {
+            busyPollMissRun = 0;
+            busyPollCur >>= 1;
+        }
+    }
+    return hit;
+}
+
+void AtherosE2200::serviceAction(OSObject *client, IOInterruptEventSource *src, int count)
+{
+    if (isEnabled && !polling)
+        serviceQueues();
+}
+
+/*
+ * Handlers of the MSI-X queue vectors. They only ack their own cause,
+ * so that they can't interfere with each other or the misc vector.
+ * Like serviceQueues() the rx handler is limited to rxBudget packets
+ * per pass and reschedules itself in case the budget was exhausted.
+ */
+void AtherosE2200::rxVectorOccurred(OSObject *client, IOInterruptEventSource *src, int count)
+{
+    UInt32 packets;
+    bool more;
+    
+    alxWriteMem32(ALX_ISR, ALX_ISR_RX_Q0);
+
+    if (polling)
+        return;
+    
+    packets = rxInterrupt(netif, rxBudget, NULL, NULL);
+    
+    if (aspmActive && (packets >= kAspmBurstPackets))
+        aspmExit();
+    
+    if (packets) {
+        lpiBursts++;
+        netif->flushInputQueue();
+    }
+    if (rxFillCount < numRxDesc)
+        growRxRing(kRxFillStep);
+    
+    if (spareNum < kRxNumSpareMbufs)
+        refillSpareBuffers();
+    
+    more = (packets >= rxBudget);
+    
+    /* Rather spin a little while than wait for the next interrupt. */
+    if (!more && busyPollTime)
+        more = busyPoll();
+    
+    if (more)
+        rxIntrSource->interruptOccurred(0, 0, 0);
+}
+
+void AtherosE2200::txVectorOccurred(OSObject *client, IOInterruptEventSource *src, int count)
+{
+    alxWriteMem32(ALX_ISR, ALX_ISR_TX_Q0);
+    
+    if (!polling)
+        txInterrupt(numTxDesc);
+}
+
 bool AtherosE2200::checkForDeadlock()
 {
     bool deadlock = false;
     
-    if ((txDescDoneCount == txDescDoneLast) && (txNumFreeDesc < kNumTxDesc)) {
+    if ((txConsumer.descDoneCount == txConsumer.descDoneLast) && (txShared.numFreeDesc < numTxDesc)) {
         if (++deadlockWarn >= kTxDeadlockTreshhold) {
 #ifdef DEBUG
             UInt16 i, index;
             UInt16 stalledIndex = alxReadMem16(ALX_TPD_PRI0_CIDX);
 
             for (i = 0; i < 10; i++) {
-                index = ((stalledIndex - 4 + i) & kTxDescMask);
+                index = ((stalledIndex - 4 + i) & txDescMask);
                 IOLog("desc[%u]: lenght=0x%x, vlanTag=0x%x, word1=0x%x, addr=0x%llx.\n", index, txDescArray[index].length, txDescArray[index].vlanTag, txDescArray[index].word1, txDescArray[index].adrl.addr);
             }
 #endif
@@ -1309,6 +1761,25 @@ void AtherosE2200::setLinkUp()
     alxPostPhyLink();
     alx_enable_aspm(&hw, false, false);
     pciDevice->setASPMState(this, 0);
+    
+    fcLastOverflows = hw.stats.rx_ov_rxf;
+    fcLastTxPause = hw.stats.tx_pause;
+    
+    /* LPI is allowed by the timer once the link has settled. */
+    lpiSetState(false);
+    lpiBursts = 0;
+    lpiDecisnTimer = 0;
+    lpiLastPackets = hw.stats.rx_ok + hw.stats.tx_ok;
+    
+    if (eeeEnable && adaptiveLpi) {
+        lpiWaitTimer = (hw.link_speed == SPEED_1000) ? kLpiWait1000US : kLpiWait100US;
+        alxWriteMem32(ALX_LPI_WAIT, lpiWaitTimer);
+    }
+    
+    /* The ASPM governor starts over with every link up. */
+    aspmActive = false;
+    aspmIdleCount = 0;
+    aspmLastPackets = hw.stats.rx_ok + hw.stats.tx_ok;
 
     /* Adjust MAC's speed, duplex and flow control settings. */
     alx_start_mac(&hw);
@@ -1335,6 +1806,9 @@ void AtherosE2200::setLinkUp()
             pollParams.pollIntervalTime = (hw.link_speed == SPEED_1000) ? 170000 : 1000000;  /* 170µs / 1ms */
         }
         netif->setPacketPollingParameters(&pollParams, 0);
+        
+        /* The per-speed values above are the starting point for the poll controller. */
+        bzero(&pollStats, sizeof(QCAPollStats));
     }
     /* Start output thread, statistics update and watchdog. */
     netif->startOutputThread();
@@ -1352,6 +1826,10 @@ void AtherosE2200::setLinkUp()
 void AtherosE2200::setLinkDown()
 {
     timerSource->cancelTimeout();
+    
+    /* L1 is enabled below while the link is down, that's not an exit. */
+    if (aspmActive)
+        aspmStop();
 
     deadlockWarn = 0;
     
@@ -1359,17 +1837,26 @@ void AtherosE2200::setLinkDown()
     netif->stopOutputThread();
     netif->flushOutputQueue();
     
+    /* The output thread is stopped, so that the pacer can't be rearmed. */
+    paceTimerSource->cancelTimeout();
+    txShared.paceArmed = 0;
+    
     /* Update link status. */
     linkUp = false;
     setLinkStatus(kIONetworkLinkValid);
     
     alx_reset_mac(&hw);
+    lpiSetState(false);
     
     intrMask = (ALX_ISR_MISC | ALX_ISR_PHY);
     alxWriteMem32(ALX_IMR, intrMask);
 
     /* Cleanup transmitter ring. */
     clearDescriptors();
+    
+    /* Switch the rx buffer size while the MAC is in reset. */
+    if (rxBufferSizeNew != rxBufferSize)
+        resizeRxBuffers();
 
     hw.link_speed = SPEED_UNKNOWN;
     hw.duplex = DUPLEX_UNKNOWN;
@@ -1431,6 +1918,9 @@ bool AtherosE2200::initPCIConfigSpace(IOPCIDevice *provider)
         DebugLog("PCIe device capabilities: 0x%08x.\n", provider->extendedConfigRead32(pcieCapOffset + kIOPCIEDevCapability));
         DebugLog("PCIe link capabilities: 0x%08x, link control: 0x%04x.\n", pcieLinkCap, pcieLinkCtl);
         
+        /* Upper bound of the L1 exit latency, encoded as 2^n µs. */
+        setProperty(kAspmExitLatencyMaxName, (1 << ((pcieLinkCap >> 15) & 0x7)), 32);
+        
 #ifdef DEBUG
         if (pcieLinkCtl & kIOPCIELinkCtlASPM)
             IOLog("PCIe ASPM enabled.\n");
@@ -1458,7 +1948,7 @@ done:
 
 bool AtherosE2200::alxResetPCIe()
 {
-	UInt8 rev = alx_hw_revision(&hw);
+	UInt8 rev = chipRev;
 	UInt32 val;
 	UInt16 val16;
     bool result = false;
@@ -1481,6 +1971,7 @@ bool AtherosE2200::alxResetPCIe()
 	/* clear WoL setting/status */
 	val = alxReadMem32(ALX_WOL0);
 	alxWriteMem32(ALX_WOL0, 0);
+    alx_config_pmofld(&hw, NULL);
     
 	val = alxReadMem32(ALX_PDLL_TRNS1);
 	alxWriteMem32(ALX_PDLL_TRNS1, val & ~ALX_PDLL_TRNS1_D3PLLOFF_EN);
@@ -1558,6 +2049,20 @@ IOReturn AtherosE2200::setPowerStateSleepAction(OSObject *owner, void *arg1, voi
     return kIOReturnSuccess;
 }
 
+void AtherosE2200::reportResumeLatency()
+{
+    UInt64 now, delta;
+    UInt32 ms;
+    
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - resumeStamp, &delta);
+    ms = (UInt32)(delta / 1000000);
+    resumeStamp = 0;
+    
+    setProperty(kResumeLatencyName, ms, 32);
+    IOLog("First packet received %u ms after wakeup on en%u.\n", ms, netif->getUnitNumber());
+}
+
 bool AtherosE2200::alxLoadDefaultAddress()
 {
     UInt32 val;
@@ -1700,7 +2205,7 @@ bool AtherosE2200::alxStart(UInt32 maxIntrRate)
         goto done;
 	}
     IOLog("%s: (Rev. %u) at 0x%p, %2.2x:%2.2x:%2.2x:%2.2x:%2.2x:%2.2x\n",
-          chipNames[chip], pciDeviceData.revision, baseAddr,
+          chipInfoArray[chip].name, pciDeviceData.revision, baseAddr,
           origMacAddr.bytes[0], origMacAddr.bytes[1],
           origMacAddr.bytes[2], origMacAddr.bytes[3],
           origMacAddr.bytes[4], origMacAddr.bytes[5]);
@@ -1713,7 +2218,6 @@ done:
 void AtherosE2200::alxEnable()
 {
     const IONetworkMedium *selectedMedium = getSelectedMedium();
-    UInt32 msiControl = ((hw.imt >> 1) << ALX_MSI_RETRANS_TM_SHIFT);
     
     if (!selectedMedium) {
         DebugLog("No medium selected. Falling back to autonegotiation.\n");
@@ -1734,17 +2238,8 @@ void AtherosE2200::alxEnable()
     alxResetPhy();
     alx_reset_mac(&hw);
 	alxConfigure();
+    alxConfigureMSI();
     
-	if (useMSI) {
-		alxWriteMem32(ALX_MSI_RETRANS_TIMER, msiControl | ALX_MSI_MASK_SEL_LINE);
-        
-        /* Configure vector mapping. */
-        alxWriteMem32(ALX_MSI_MAP_TBL1, 0);
-        alxWriteMem32(ALX_MSI_MAP_TBL2, 0);
-        alxWriteMem32(ALX_MSI_ID_MAP, 0);
-	} else {
-        alxWriteMem32(ALX_MSI_RETRANS_TIMER, 0);
-    }
     alx_enable_aspm(&hw, false, true);
     pciDevice->setASPMState(this, kIOPCIELinkCtlL1);
 
@@ -1755,6 +2250,68 @@ void AtherosE2200::alxEnable()
     alxEnableIRQ();
 }
 
+/* AtherosE2200::alxResume()
+ *
+ * Fast path of alxEnable() used after a wakeup. The descriptor rings and
+ * the receive buffers have been kept in place, the MAC's register state is
+ * replayed from the shadow saved by disable() and the PHY is reset only in
+ * case it lost power while we were asleep. Returns true if the PHY kept its
+ * configuration so that the caller has to check the link status itself.
+ */
+
+bool AtherosE2200::alxResume()
+{
+    const IONetworkMedium *selectedMedium = getSelectedMedium();
+    bool phyConfigured;
+    
+    if (!selectedMedium) {
+        DebugLog("No medium selected. Falling back to autonegotiation.\n");
+        selectedMedium = mediumTable[MEDIUM_INDEX_AUTO];
+        setCurrentMedium(selectedMedium);
+    }
+    setLinkStatus(kIONetworkLinkValid);
+    
+    polling = false;
+    
+    hw.link_speed = SPEED_UNKNOWN;
+    hw.duplex = DUPLEX_UNKNOWN;
+    
+    alxSpeedDuplexForMedium(selectedMedium);
+    alxResetPCIe();
+    
+    phyConfigured = alx_phy_configured(&hw);
+    
+    if (phyConfigured) {
+        DebugLog("PHY configuration retained during sleep.\n");
+        alx_write_phy_reg(&hw, ALX_MII_IER, ALX_IER_LINK_UP | ALX_IER_LINK_DOWN);
+    } else {
+        DebugLog("PHY lost power during sleep. Resetting PHY.\n");
+        alxResetPhy();
+        alxSetupSpeedDuplex(hw.adv_cfg, eeeAdv, hw.flowctrl);
+    }
+    /* The MAC reset loads MAC_CTRL, so it has to be restored first. */
+    hw.rx_ctrl = regShadow.macCtrl;
+    alx_reset_mac(&hw);
+    alxRestoreRegShadow();
+    alxConfigure();
+    
+    if (promiscusMode)
+        setPromiscuousMode(true);
+    
+    alxConfigureMSI();
+    
+    alx_enable_aspm(&hw, false, true);
+    pciDevice->setASPMState(this, kIOPCIELinkCtlL1);
+    
+    /* clear old interrupts */
+    alxWriteMem32(ALX_ISR, ~(UInt32)ALX_ISR_DIS);
+    
+    /* Enable all known interrupts by setting the interrupt mask. */
+    alxEnableIRQ();
+    
+    return phyConfigured;
+}
+
 int AtherosE2200::alxDisable()
 {
     int error;
@@ -1763,6 +2320,9 @@ int AtherosE2200::alxDisable()
 
     alxDisableIRQ();
     
+    if (aspmActive)
+        aspmStop();
+    
     hw.link_speed = SPEED_UNKNOWN;
     hw.duplex = DUPLEX_UNKNOWN;
     
@@ -1793,6 +2353,8 @@ int AtherosE2200::alxDisable()
             DebugLog("alx_pre_suspend() failed.\n");
             goto done;
         }
+        alxConfigSleepProxy();
+        
         error = alx_config_wol(&hw);
         
         if (error) {
@@ -1811,6 +2373,60 @@ done:
     return error;
 }
 
+/* AtherosE2200::alxConfigSleepProxy()
+ *
+ * Load the interface's IPv4 address and up to four IPv6 addresses into
+ * the chip's offload engine, so that it answers ARP requests and neighbor
+ * solicitations on its own while we are asleep. IPv6 addresses are grouped
+ * by their solicited-node address, two engines with two targets each.
+ * With synWakePort set, a TCP SYN to that port on the IPv4 address or the
+ * first global IPv6 address wakes the machine.
+ */
+
+void AtherosE2200::alxConfigSleepProxy()
+{
+    struct alx_pmofld ofld;
+    struct sockaddr_storage ss;
+    ifaddr_t *addrs;
+    ifnet_t ifp = netif->getIfnet();
+    int i;
+    
+    bzero(&ofld, sizeof(ofld));
+
+    if (!((sleepProxy || synWakePort) && (hw.sleep_ctrl & ALX_SLEEP_CIFS)))
+        goto done;
+    
+    memcpy(ofld.mac, &currMacAddr.bytes[0], ETH_ALEN);
+    
+    if (!ifnet_get_address_list_family(ifp, &addrs, AF_INET)) {
+        for (i = 0; addrs[i]; i++) {
+            if (ifaddr_address(addrs[i], (struct sockaddr *)&ss, sizeof(ss)) || (ss.ss_family != AF_INET))
+                continue;
+            
+            memcpy(ofld.ipv4, &((struct sockaddr_in *)&ss)->sin_addr, 4);
+            ofld.arp = sleepProxy;
+            ofld.syn_v4 = (synWakePort != 0);
+            break;
+        }
+        ifnet_free_address_list(addrs);
+    }
+    if (!ifnet_get_address_list_family(ifp, &addrs, AF_INET6)) {
+        for (i = 0; addrs[i]; i++) {
+            if (ifaddr_address(addrs[i], (struct sockaddr *)&ss, sizeof(ss)) || (ss.ss_family != AF_INET6))
+                continue;
+            
+            alx_pmofld_add_ipv6(&ofld, ((struct sockaddr_in6 *)&ss)->sin6_addr.s6_addr, sleepProxy, (synWakePort != 0));
+        }
+        ifnet_free_address_list(addrs);
+    }
+    ofld.syn_port = synWakePort;
+    
+    DebugLog("Sleep proxy: ARP %s, %d NS engine(s), SYN wake %s.\n", ofld.arp ? "on" : "off", ofld.num_ns, (ofld.syn_v4 || ofld.syn_v6) ? "on" : "off");
+    
+done:
+    alx_config_pmofld(&hw, &ofld);
+}
+
 /* Reset the NIC in case a tx deadlock or a pci error occurred. timerSource and txQueue
  * are stopped immediately but will be restarted by checkLinkStatus() when the link has
  * been reestablished.
@@ -1866,11 +2482,62 @@ void AtherosE2200::alxConfigure()
 	alxWriteMem32(ALX_MAC_CTRL, hw.rx_ctrl);
 }
 
+void AtherosE2200::alxConfigureMSI()
+{
+    UInt32 msiControl = ((hw.imt >> 1) << ALX_MSI_RETRANS_TM_SHIFT);
+
+    if (useMSIX) {
+		alxWriteMem32(ALX_MSI_RETRANS_TIMER, msiControl);
+        
+        /* Route rx and tx queue 0 to their own vectors, everything else to vector 0. */
+        alxWriteMem32(ALX_MSI_MAP_TBL1, (kMSIXVectorRx << ALX_MSI_MAP_TBL1_RXQ0_SHIFT) | (kMSIXVectorTx << ALX_MSI_MAP_TBL1_TXQ0_SHIFT));
+        alxWriteMem32(ALX_MSI_MAP_TBL2, 0);
+        alxWriteMem32(ALX_MSI_ID_MAP, 0);
+    } else if (useMSI) {
+		alxWriteMem32(ALX_MSI_RETRANS_TIMER, msiControl | ALX_MSI_MASK_SEL_LINE);
+        
+        /* Configure vector mapping. */
+        alxWriteMem32(ALX_MSI_MAP_TBL1, 0);
+        alxWriteMem32(ALX_MSI_MAP_TBL2, 0);
+        alxWriteMem32(ALX_MSI_ID_MAP, 0);
+	} else {
+        alxWriteMem32(ALX_MSI_RETRANS_TIMER, 0);
+    }
+}
+
+/*
+ * Capture the register state which can't be derived from the driver's
+ * configuration, so that alxResume() is able to replay it after a wakeup.
+ * Everything alxConfigure() recomputes (RXQ0, FAST_PAUSE and the filter
+ * mode bits) is left out as it would override the current configuration.
+ */
+void AtherosE2200::alxSaveRegShadow()
+{
+    regShadow.macCtrl = hw.rx_ctrl & ~(ALX_MAC_CTRL_RX_EN | ALX_MAC_CTRL_TX_EN | ALX_MAC_CTRL_FAST_PAUSE | ALX_MAC_CTRL_MULTIALL_EN | ALX_MAC_CTRL_PROMISC_EN);
+    regShadow.hashTable[0] = alxReadMem32(ALX_HASH_TBL0);
+    regShadow.hashTable[1] = alxReadMem32(ALX_HASH_TBL1);
+    regShadow.stationAddr[0] = alxReadMem32(ALX_STAD0);
+    regShadow.stationAddr[1] = alxReadMem32(ALX_STAD1);
+    regShadow.captured = true;
+}
+
+/*
+ * Must be called before alxConfigure() which programs the hash table
+ * from multicastFilter and writes MAC_CTRL with the derived bits.
+ */
+void AtherosE2200::alxRestoreRegShadow()
+{
+    multicastFilter[0] = regShadow.hashTable[0];
+    multicastFilter[1] = regShadow.hashTable[1];
+    
+    alxWriteMem32(ALX_STAD0, regShadow.stationAddr[0]);
+    alxWriteMem32(ALX_STAD1, regShadow.stationAddr[1]);
+}
+
 void AtherosE2200::alxConfigureBasic()
 {
 	UInt32 val, rawMTU, maxPayload;
-	UInt16 val16;
-	u8 chipRev = alx_hw_revision(&hw);
+	UInt16 val16, txImt;
         
 	alxWriteMem32(ALX_CLK_GATE, ALX_CLK_GATE_ALL);
     
@@ -1883,12 +2550,23 @@ void AtherosE2200::alxConfigureBasic()
 	val = alxReadMem32(ALX_MASTER);
 	val |= ALX_MASTER_IRQMOD2_EN | ALX_MASTER_IRQMOD1_EN | ALX_MASTER_SYSALVTIMER_EN;
 	alxWriteMem32(ALX_MASTER, val);
-	alxWriteMem32(ALX_IRQ_MODU_TIMER, (hw.imt >> 1) << ALX_IRQ_MODU_TIMER1_SHIFT);
+    
+    /*
+     * With separate vectors timer 1 moderates tx completions and
+     * timer 2 moderates rx, each at its own rate.
+     */
+    if (useMSIX) {
+        txImt = (UInt16)(1000000 / txIntrRate);
+        alxWriteMem32(ALX_IRQ_MODU_TIMER, ((txImt >> 1) << ALX_IRQ_MODU_TIMER1_SHIFT) | ((hw.imt >> 1) << ALX_IRQ_MODU_TIMER2_SHIFT));
+    } else {
+        txImt = hw.imt;
+        alxWriteMem32(ALX_IRQ_MODU_TIMER, (hw.imt >> 1) << ALX_IRQ_MODU_TIMER1_SHIFT);
+    }
 	/* intr re-trig timeout */
 	alxWriteMem32(ALX_INT_RETRIG, ALX_INT_RETRIG_TO);
 	/* tpd threshold to trig int */
 	alxWriteMem32(ALX_TINT_TPD_THRSHLD, hw.ith_tpd);
-	alxWriteMem32(ALX_TINT_TIMER, hw.imt);
+	alxWriteMem32(ALX_TINT_TIMER, txImt);
     
 	rawMTU = ALX_RAW_MTU(hw.mtu);
 	alxWriteMem32(ALX_MTU, rawMTU);
@@ -1917,32 +2595,35 @@ void AtherosE2200::alxConfigureBasic()
         pciDevice->extendedConfigWrite16(pcieCapOffset + kIOPCIEDeviceControl, val16);
         DebugLog("Restore dma read max length: 0x%x.\n", val16);
     }
-	val = ALX_TXQ_TPD_BURSTPREF_DEF << ALX_TXQ0_TPD_BURSTPREF_SHIFT | ALX_TXQ0_MODE_ENHANCE | ALX_TXQ0_LSO_8023_EN |    ALX_TXQ0_SUPT_IPOPT | ALX_TXQ_TXF_BURST_PREF_DEF << ALX_TXQ0_TXF_BURST_PREF_SHIFT;
+	val = dmaParams.tpdBurst << ALX_TXQ0_TPD_BURSTPREF_SHIFT | ALX_TXQ0_MODE_ENHANCE | ALX_TXQ0_LSO_8023_EN |    ALX_TXQ0_SUPT_IPOPT | (UInt32)dmaParams.txfBurst << ALX_TXQ0_TXF_BURST_PREF_SHIFT;
 	alxWriteMem32(ALX_TXQ0, val);
-	val = ALX_TXQ_TPD_BURSTPREF_DEF << ALX_HQTPD_Q1_NUMPREF_SHIFT | ALX_TXQ_TPD_BURSTPREF_DEF << ALX_HQTPD_Q2_NUMPREF_SHIFT | ALX_TXQ_TPD_BURSTPREF_DEF << ALX_HQTPD_Q3_NUMPREF_SHIFT | ALX_HQTPD_BURST_EN;
+	val = dmaParams.tpdBurst << ALX_HQTPD_Q1_NUMPREF_SHIFT | dmaParams.tpdBurst << ALX_HQTPD_Q2_NUMPREF_SHIFT | dmaParams.tpdBurst << ALX_HQTPD_Q3_NUMPREF_SHIFT | ALX_HQTPD_BURST_EN;
 	alxWriteMem32(ALX_HQTPD, val);
     
 	/* rxq, flow control */
 	val = alxReadMem32(ALX_SRAM5);
-	val = ALX_GET_FIELD(val, ALX_SRAM_RXF_LEN) << 3;
+	rxFifoSize = ALX_GET_FIELD(val, ALX_SRAM_RXF_LEN) << 3;
     
-	if (val > ALX_SRAM_RXF_LEN_8K) {
-		val16 = ALX_MTU_STD_ALGN >> 3;
-		val = (val - ALX_RXQ2_RXF_FLOW_CTRL_RSVD) >> 3;
-	} else {
-		val16 = ALX_MTU_STD_ALGN >> 3;
-		val = (val - ALX_MTU_STD_ALGN) >> 3;
-	}
-	alxWriteMem32(ALX_RXQ2, val16 << ALX_RXQ2_RXF_XOFF_THRESH_SHIFT | val << ALX_RXQ2_RXF_XON_THRESH_SHIFT);
-	val = ALX_RXQ0_NUM_RFD_PREF_DEF << ALX_RXQ0_NUM_RFD_PREF_SHIFT | ALX_RXQ0_RSS_MODE_DIS << ALX_RXQ0_RSS_MODE_SHIFT |ALX_RXQ0_IDT_TBL_SIZE_DEF << ALX_RXQ0_IDT_TBL_SIZE_SHIFT | ALX_RXQ0_RSS_HSTYP_ALL | ALX_RXQ0_RSS_HASH_EN |    ALX_RXQ0_IPV6_PARSE_EN;
+    if (fcFastPause)
+        hw.rx_ctrl |= ALX_MAC_CTRL_FAST_PAUSE;
+    
+    alxSetFlowCtrlThresholds();
     
-	if (alx_hw_giga(&hw))
+	val = dmaParams.rfdPrefetch << ALX_RXQ0_NUM_RFD_PREF_SHIFT | ALX_RXQ0_RSS_MODE_DIS << ALX_RXQ0_RSS_MODE_SHIFT |ALX_RXQ0_IDT_TBL_SIZE_DEF << ALX_RXQ0_IDT_TBL_SIZE_SHIFT | ALX_RXQ0_RSS_HSTYP_ALL | ALX_RXQ0_RSS_HASH_EN |    ALX_RXQ0_IPV6_PARSE_EN;
+    
+	if (gbCapable)
 		ALX_SET_FIELD(val, ALX_RXQ0_ASPM_THRESH, ALX_RXQ0_ASPM_THRESH_100M);
     
 	alxWriteMem32(ALX_RXQ0, val);
     
+    /* Zero read channels selects all the chip supports. */
+    if (dmaParams.readChannels && (dmaParams.readChannels < hw.max_dma_chnl))
+        hw.dma_chnl = dmaParams.readChannels;
+    else
+        hw.dma_chnl = hw.max_dma_chnl;
+    
 	val = alxReadMem32(ALX_DMA);
-	val = ALX_DMA_RORDER_MODE_OUT << ALX_DMA_RORDER_MODE_SHIFT | ALX_DMA_RREQ_PRI_DATA | maxPayload << ALX_DMA_RREQ_BLEN_SHIFT | ALX_DMA_WDLY_CNT_DEF << ALX_DMA_WDLY_CNT_SHIFT | ALX_DMA_RDLY_CNT_DEF << ALX_DMA_RDLY_CNT_SHIFT | (hw.dma_chnl - 1) << ALX_DMA_RCHNL_SEL_SHIFT;
+	val = ALX_DMA_RORDER_MODE_OUT << ALX_DMA_RORDER_MODE_SHIFT | ALX_DMA_RREQ_PRI_DATA | maxPayload << ALX_DMA_RREQ_BLEN_SHIFT | dmaParams.writeDelay << ALX_DMA_WDLY_CNT_SHIFT | dmaParams.readDelay << ALX_DMA_RDLY_CNT_SHIFT | (hw.dma_chnl - 1) << ALX_DMA_RCHNL_SEL_SHIFT;
 	alxWriteMem32(ALX_DMA, val);
     
 	/* default multi-tx-q weights */
@@ -2005,30 +2686,35 @@ void AtherosE2200::alxInitDescRings()
 	UInt32 addrHigh = (rxRetPhyAddr >> 32);
     UInt32 addrLow;
     
-    txDirtyDescIndex = txNextDescIndex = 0;
-    txNumFreeDesc = kNumTxDesc;
+    txConsumer.dirtyDescIndex = txProducer.nextDescIndex = 0;
+    txShared.numFreeDesc = numTxDesc;
+    txShared.bytesInFlight = 0;
+    txShared.queueLimited = 0;
+    txShared.probeStamp = 0;
+    txProducer.paceTokens = kTxPaceBurst;
+    clock_get_uptime(&txProducer.paceStamp);
     rxNextDescIndex = 0;
 
     addrLow = (UInt32)(rxRetPhyAddr & 0xffffffff);
 	alxWriteMem32(ALX_RX_BASE_ADDR_HI, addrHigh);
 	alxWriteMem32(ALX_RRD_ADDR_LO, addrLow);
-	alxWriteMem32(ALX_RRD_RING_SZ, kNumRxDesc);
+	alxWriteMem32(ALX_RRD_RING_SZ, numRxDesc);
     
     addrLow = (UInt32)(rxFreePhyAddr & 0xffffffff);
 	alxWriteMem32(ALX_RFD_ADDR_LO, addrLow);
-	alxWriteMem32(ALX_RFD_RING_SZ, kNumRxDesc);
-	alxWriteMem32(ALX_RFD_BUF_SZ, kRxBufferPktSize);
+	alxWriteMem32(ALX_RFD_RING_SZ, numRxDesc);
+	alxWriteMem32(ALX_RFD_BUF_SZ, rxBufferSize);
     
     addrHigh = (txPhyAddr >> 32);
     addrLow = (UInt32)(txPhyAddr & 0xffffffff);
 	alxWriteMem32(ALX_TX_BASE_ADDR_HI, addrHigh);
 	alxWriteMem32(ALX_TPD_PRI0_ADDR_LO, addrLow);
-	alxWriteMem32(ALX_TPD_RING_SZ, kNumTxDesc);
+	alxWriteMem32(ALX_TPD_RING_SZ, numTxDesc);
     
 	/* load these pointers into the chip */
 	alxWriteMem32(ALX_SRAM9, ALX_SRAM_LOAD_PTR);
     
-    alxWriteMem16(ALX_RFD_PIDX, kRxLastDesc);
+    alxWriteMem16(ALX_RFD_PIDX, rxFillCount - 1);
 }
 
 inline void AtherosE2200::alxEnableIRQ()
@@ -2048,70 +2734,29 @@ inline void AtherosE2200::alxDisableIRQ()
 
 bool AtherosE2200::alxIdentifyChip()
 {
-    int rev;
+    UInt32 i;
     bool result = false;
     
-    switch (pciDeviceData.device) {
-        case ALX_DEV_ID_AR8162:
-            chip = kChipAR8162;
-            gbCapable = false;
-            eeeCap = ALX_LOCAL_EEEADV_100BT;
-            DebugLog("Found AR8162.\n");
-            break;
-            
-        case ALX_DEV_ID_AR8161:
-            chip = kChipAR8161;
-            gbCapable = true;
-            eeeCap = (ALX_LOCAL_EEEADV_100BT | ALX_LOCAL_EEEADV_1000BT);
-            DebugLog("Found AR8161.\n");
-            break;
-            
-        case ALX_DEV_ID_AR8172:
-            chip = kChipAR8172;
-            gbCapable = false;
-            eeeCap = ALX_LOCAL_EEEADV_100BT;
-            DebugLog("Found AR8172.\n");
-            break;
-            
-        case ALX_DEV_ID_AR8171:
-            chip = kChipAR8171;
-            gbCapable = true;
-            eeeCap = (ALX_LOCAL_EEEADV_100BT | ALX_LOCAL_EEEADV_1000BT);
-            DebugLog("Found AR8171.\n");
-            break;
-            
-        case ALX_DEV_ID_E2200:
-            chip = kChipKillerE2200;
-            gbCapable = true;
-            eeeCap = (ALX_LOCAL_EEEADV_100BT | ALX_LOCAL_EEEADV_1000BT);
-            DebugLog("Found Killer E2200.\n");
-            break;
-            
-        case ALX_DEV_ID_E2400:
-            chip = kChipKillerE2400;
-            gbCapable = true;
-            eeeCap = (ALX_LOCAL_EEEADV_100BT | ALX_LOCAL_EEEADV_1000BT);
-            DebugLog("Found Killer E2400.\n");
-            break;
-            
-        case ALX_DEV_ID_E2500:
-            chip = kChipKillerE2500;
-            gbCapable = true;
-            eeeCap = (ALX_LOCAL_EEEADV_100BT | ALX_LOCAL_EEEADV_1000BT);
-            DebugLog("Found Killer E2500.\n");
-            break;
-            
-        default:
-            IOLog("Unknown chip. Aborting.\n");
-            goto done;
+    for (i = kChipAR8161; i < kNumChips; i++) {
+        if (chipInfoArray[i].deviceID == pciDeviceData.device)
             break;
     }
-	rev = alx_hw_revision(&hw);
+    if (i == kNumChips) {
+        IOLog("Unknown chip. Aborting.\n");
+        goto done;
+    }
+    chip = i;
+    gbCapable = chipInfoArray[i].gbCapable;
+    eeeCap = chipInfoArray[i].eeeCap;
+    DebugLog("Found %s.\n", chipInfoArray[i].name);
     
-	if (rev > ALX_REV_C0)
+    /* The revision doesn't change, so there is no need to decode it over and over again. */
+	chipRev = alx_hw_revision(&hw);
+    
+	if (chipRev > ALX_REV_C0)
         goto done;
     
-	hw.max_dma_chnl = (rev >= ALX_REV_B0) ? 4 : 2;
+	hw.max_dma_chnl = (chipRev >= ALX_REV_B0) ? 4 : 2;
     result = true;
     
 done:
@@ -2284,7 +2929,7 @@ void AtherosE2200::alxResetPhy()
 void AtherosE2200::alxPostPhyLink()
 {
     UInt16 phy_val, len, agc;
-    UInt8 revid = alx_hw_revision(&hw);
+    UInt8 revid = chipRev;
     bool adj_th = revid == ALX_REV_B0;
     
     if (revid != ALX_REV_B0 && !alx_is_rev_a(revid))
@@ -2379,7 +3024,7 @@ int AtherosE2200::alxSetupSpeedDuplex(UInt32 ethadv, UInt16 eeeadv, UInt8 flowct
             }
         }
         giga = 0;
-        if (alx_hw_giga(&hw))
+        if (gbCapable)
             giga = ethtool_adv_to_mii_ctrl1000_t(ethadv);
         
         cr = BMCR_RESET | BMCR_ANENABLE | BMCR_ANRESTART;
@@ -2610,8 +3255,6 @@ IOReturn AtherosE2200::alxActiveMediumIndex(UInt32 *index)
 
 void AtherosE2200::timerAction(IOTimerEventSource *timer)
 {
-    UInt32 lpi;
-    
     if (!linkUp) {
         DebugLog("Timer fired while link down.\n");
         goto done;
@@ -2621,23 +3264,48 @@ void AtherosE2200::timerAction(IOTimerEventSource *timer)
         goto done;
     
     updateStatitics();
+    txQueueAdjustLimit();
+    fcUpdate();
+    
+    /* Complete the rx ring in case there was too little traffic to do so. */
+    if (rxFillCount < numRxDesc)
+        growRxRing(numRxDesc);
+    
+    if (rxPoll && adaptivePoll)
+        updatePollParams();
+    
+    aspmUpdate();
+    
+    if (busyPollTime) {
+        /* Start a new budget period and recover from backoff. */
+        busyPollSpent = 0;
+        
+        if (busyPollCur < busyPollTime) {
+            busyPollCur = (busyPollCur) ? (busyPollCur << 1) : 1;
+            
+            if (busyPollCur > busyPollTime)
+                busyPollCur = busyPollTime;
+        }
+        
+        setProperty(kBusyPollHitsName, busyPollHits, 32);
+        setProperty(kBusyPollMissesName, busyPollMisses, 32);
+    }
     timerSource->setTimeoutMS(kTimeoutMS);
 
-    if (eeeEnable) {
-        eeeEnable = 0;
-        lpi = alxReadMem32(ALX_LPI_CTRL);
-        lpi |= ALX_LPI_CTRL_EN;
-        alxWriteMem32(ALX_LPI_CTRL, lpi);
-        DebugLog("Enable LPI: ALX_LPI_CTRL=0x%08x.\n", lpi);
-    }
+    if (eeeEnable)
+        lpiUpdate();
+
 done:
-    txDescDoneLast = txDescDoneCount;
+    txConsumer.descDoneLast = txConsumer.descDoneCount;
     
     //DebugLog("timerAction() <===\n");
 }
 
 void AtherosE2200::updateStatitics()
 {
+    UInt64 rxSizes[kFrameSizeBuckets];
+    UInt64 txSizes[kFrameSizeBuckets];
+
     alx_update_hw_stats(&hw);
     
     netStats->inputPackets = (UInt32)hw.stats.rx_ok;
@@ -2652,6 +3320,329 @@ void AtherosE2200::updateStatitics()
     etherStats->dot3StatsEntry.alignmentErrors = (UInt32)hw.stats.rx_align_err;
     etherStats->dot3StatsEntry.missedFrames = (UInt32)(hw.stats.rx_ov_rrd + hw.stats.rx_ov_rrd);
     etherStats->dot3TxExtraEntry.underruns = (UInt32)hw.stats.tx_underrun;
+    
+    rxSizes[0] = hw.stats.rx_sz_64B;
+    rxSizes[1] = hw.stats.rx_sz_127B;
+    rxSizes[2] = hw.stats.rx_sz_255B;
+    rxSizes[3] = hw.stats.rx_sz_511B;
+    rxSizes[4] = hw.stats.rx_sz_1023B;
+    rxSizes[5] = hw.stats.rx_sz_1518B;
+    rxSizes[6] = hw.stats.rx_sz_max;
+    
+    txSizes[0] = hw.stats.tx_sz_64B;
+    txSizes[1] = hw.stats.tx_sz_127B;
+    txSizes[2] = hw.stats.tx_sz_255B;
+    txSizes[3] = hw.stats.tx_sz_511B;
+    txSizes[4] = hw.stats.tx_sz_1023B;
+    txSizes[5] = hw.stats.tx_sz_1518B;
+    txSizes[6] = hw.stats.tx_sz_max;
+    
+    updateFrameStats(&rxFrameStats, rxSizes, hw.stats.rx_byte_cnt, kRxFrameSizesName, kRxFrameAvgName, kRxSmallFramesName);
+    updateFrameStats(&txFrameStats, txSizes, hw.stats.tx_byte_cnt, kTxFrameSizesName, kTxFrameAvgName, kTxSmallFramesName);
+}
+
+static const char *frameSizeKeys[kFrameSizeBuckets] = {
+    "64", "65-127", "128-255", "256-511", "512-1023", "1024-1518", "1519-max"
+};
+
+/* AtherosE2200::updateFrameStats()
+ *
+ * Publish the frame size histogram of one direction and derive the
+ * average frame size and the share of small frames (up to 127 bytes)
+ * of the last timer period. The average is kept in stats, the poll
+ * controller scales its byte thresholds with the rx average.
+ */
+
+void AtherosE2200::updateFrameStats(QCAFrameStats *stats, const UInt64 *sizes, UInt64 bytes, const char *histName, const char *avgName, const char *smallName)
+{
+    OSDictionary *dict = OSDictionary::withCapacity(kFrameSizeBuckets);
+    OSNumber *num;
+    UInt64 packets = 0;
+    UInt64 small = sizes[0] + sizes[1];
+    UInt64 delta;
+    UInt32 smallPercent;
+    UInt32 i;
+    
+    for (i = 0; i < kFrameSizeBuckets; i++) {
+        packets += sizes[i];
+        
+        if (dict && (num = OSNumber::withNumber(sizes[i], 64))) {
+            dict->setObject(frameSizeKeys[i], num);
+            num->release();
+        }
+    }
+    if (dict) {
+        setProperty(histName, dict);
+        dict->release();
+    }
+    delta = packets - stats->lastPackets;
+    
+    /* Keep the last values in case the link was idle. */
+    if (delta) {
+        stats->avgSize = (UInt32)((bytes - stats->lastBytes) / delta);
+        smallPercent = (UInt32)(((small - stats->lastSmall) * 100) / delta);
+        
+        setProperty(avgName, stats->avgSize, 32);
+        setProperty(smallName, smallPercent, 32);
+    }
+    stats->lastPackets = packets;
+    stats->lastBytes = bytes;
+    stats->lastSmall = small;
+}
+
+/* AtherosE2200::alxSetFlowCtrlThresholds()
+ *
+ * Derive the rx FIFO watermarks from the MTU and the FIFO size. A pause
+ * frame is sent when the FIFO fills up to the high watermark (the XON
+ * field) and released below the low watermark (the XOFF field). Both are
+ * in 8 byte units.
+ */
+
+void AtherosE2200::alxSetFlowCtrlThresholds()
+{
+    UInt32 frame = (ALX_RAW_MTU(hw.mtu) + 7) & ~7;
+    UInt32 reserve = 2 * frame + kFcLinkOverhead + fcReserveExtra;
+    
+    /* Small FIFOs can't hold two jumbo frames, settle for less. */
+    if (reserve > (rxFifoSize >> 1))
+        reserve = rxFifoSize >> 1;
+    
+    if (reserve < ALX_MTU_STD_ALGN)
+        reserve = ALX_MTU_STD_ALGN;
+    
+    fcHighWatermark = rxFifoSize - reserve;
+    fcLowWatermark = (frame < (fcHighWatermark >> 1)) ? frame : (fcHighWatermark >> 1);
+    
+    alxWriteMem32(ALX_RXQ2, ((fcLowWatermark >> 3) & ALX_RXQ2_RXF_XOFF_THRESH_MASK) << ALX_RXQ2_RXF_XOFF_THRESH_SHIFT | ((fcHighWatermark >> 3) & ALX_RXQ2_RXF_XON_THRESH_MASK) << ALX_RXQ2_RXF_XON_THRESH_SHIFT);
+}
+
+/* AtherosE2200::fcUpdate()
+ *
+ * Called once per timer period. Rx FIFO overflows despite flow control
+ * mean that the pause frame was sent too late, so the headroom grows and
+ * fast pause gets enabled. Bursts of pause frames from us or long quiet
+ * periods let the headroom shrink back to the computed minimum.
+ */
+
+void AtherosE2200::fcUpdate()
+{
+    UInt64 overflows = hw.stats.rx_ov_rxf - fcLastOverflows;
+    UInt64 txPause = hw.stats.tx_pause - fcLastTxPause;
+    UInt32 extra = fcReserveExtra;
+    bool fastPause = fcFastPause;
+    
+    fcLastOverflows = hw.stats.rx_ov_rxf;
+    fcLastTxPause = hw.stats.tx_pause;
+    
+    if (!(flowControl & ALX_FC_TX))
+        goto done;
+    
+    if (overflows) {
+        fcQuietPeriods = 0;
+        
+        if ((extra + kFcStep) <= (rxFifoSize >> 1))
+            extra += kFcStep;
+        
+        fastPause = true;
+    } else if ((txPause > kFcPauseStorm) || (++fcQuietPeriods >= kFcDecayPeriods)) {
+        fcQuietPeriods = 0;
+        
+        if (extra >= kFcStep)
+            extra -= kFcStep;
+        else
+            fastPause = false;
+    }
+    if ((extra != fcReserveExtra) || (fastPause != fcFastPause)) {
+        fcReserveExtra = extra;
+        fcFastPause = fastPause;
+        fcAdjustments++;
+        
+        alxSetFlowCtrlThresholds();
+        
+        /* Jumbo frames don't use fast pause by default. */
+        if (fastPause || (ALX_RAW_MTU(hw.mtu) <= (ALX_MTU_JUMBO_TH + ETH_FCS_LEN + VLAN_HLEN)))
+            hw.rx_ctrl |= ALX_MAC_CTRL_FAST_PAUSE;
+        else
+            hw.rx_ctrl &= ~ALX_MAC_CTRL_FAST_PAUSE;
+        
+        alxWriteMem32(ALX_MAC_CTRL, hw.rx_ctrl);
+        
+        DebugLog("Flow control: high %u, low %u, fast pause %s.\n", fcHighWatermark, fcLowWatermark, fastPause ? "on" : "off");
+    }
+    
+done:
+    setProperty(kFcHighWatermarkName, fcHighWatermark, 32);
+    setProperty(kFcLowWatermarkName, fcLowWatermark, 32);
+    setProperty(kFcFastPauseName, fcFastPause);
+    setProperty(kFcAdjustmentsName, fcAdjustments, 32);
+    setProperty(kRxFifoOverflowsName, hw.stats.rx_ov_rxf, 64);
+    setProperty(kFcPauseRxName, hw.stats.rx_pause, 64);
+    setProperty(kFcPauseTxName, hw.stats.tx_pause, 64);
+}
+
+/* AtherosE2200::lpiSetState()
+ *
+ * Allow or forbid the MAC to put the link into low power idle.
+ */
+
+void AtherosE2200::lpiSetState(bool enable)
+{
+    UInt32 lpi = alxReadMem32(ALX_LPI_CTRL);
+    
+    if (enable)
+        lpi |= ALX_LPI_CTRL_EN;
+    else
+        lpi &= ~ALX_LPI_CTRL_EN;
+    
+    alxWriteMem32(ALX_LPI_CTRL, lpi);
+    lpiActive = enable;
+    
+    DebugLog("%s LPI: ALX_LPI_CTRL=0x%08x.\n", enable ? "Enable" : "Suspend", lpi);
+}
+
+/* AtherosE2200::lpiUpdate()
+ *
+ * Called once per timer period while EEE has been negotiated. Derives the
+ * mean inter-packet gap of the last period and retunes the LPI decision
+ * timer or suspends LPI accordingly. Every rx burst seen while LPI was
+ * allowed and the gaps were long enough for the link to enter LPI is
+ * counted as one wakeup, which added the wake time to its latency.
+ */
+
+void AtherosE2200::lpiUpdate()
+{
+    UInt64 packets = hw.stats.rx_ok + hw.stats.tx_ok;
+    UInt64 delta = packets - lpiLastPackets;
+    UInt32 gap, decisn;
+    
+    lpiLastPackets = packets;
+    
+    if (!adaptiveLpi) {
+        if (!lpiActive)
+            lpiSetState(true);
+        
+        return;
+    }
+    gap = (delta) ? (UInt32)((kTimeoutMS * 1000ULL) / delta) : (kTimeoutMS * 1000);
+    
+    if (lpiActive && (gap >= lpiDecisnTimer)) {
+        lpiWakeups += lpiBursts;
+        lpiLatency += (UInt64)lpiBursts * lpiWaitTimer;
+    }
+    lpiBursts = 0;
+    
+    if (busyPollTime || (gap < kLpiGapMinUS)) {
+        if (lpiActive)
+            lpiSetState(false);
+    } else {
+        if (gap >= kLpiGapIdleUS)
+            decisn = kLpiDecisnMinUS;
+        else
+            decisn = (kLpiDecisnMaxUS * kLpiGapMinUS) / gap;
+        
+        if (decisn < kLpiDecisnMinUS)
+            decisn = kLpiDecisnMinUS;
+        else if (decisn > kLpiDecisnMaxUS)
+            decisn = kLpiDecisnMaxUS;
+        
+        if (decisn != lpiDecisnTimer) {
+            alxWriteMem32(ALX_LPI_DECISN_TIMER, decisn);
+            lpiDecisnTimer = decisn;
+        }
+        if (!lpiActive)
+            lpiSetState(true);
+    }
+    setProperty(kLpiDecisnTimerName, lpiDecisnTimer, 32);
+    setProperty(kLpiWakeupsName, lpiWakeups, 64);
+    setProperty(kLpiLatencyName, lpiLatency, 64);
+}
+
+/* AtherosE2200::aspmEnter()/aspmExit()/aspmStop()
+ *
+ * Switch L1 (and L0s if configured) on or off while the link is up and
+ * keep track of the time spent with ASPM enabled. aspmStop() only ends
+ * the residency period, for link down and sleep which program ASPM on
+ * their own, so that it isn't counted as an exit.
+ */
+
+void AtherosE2200::aspmEnter()
+{
+    alx_enable_aspm(&hw, aspmL0s, true);
+    pciDevice->setASPMState(this, (aspmL0s) ? (kIOPCIELinkCtlL0s | kIOPCIELinkCtlL1) : kIOPCIELinkCtlL1);
+    
+    clock_get_uptime(&aspmStamp);
+    aspmActive = true;
+    aspmEntries++;
+}
+
+void AtherosE2200::aspmExit()
+{
+    alx_enable_aspm(&hw, false, false);
+    pciDevice->setASPMState(this, 0);
+    
+    aspmStop();
+    aspmExits++;
+}
+
+void AtherosE2200::aspmStop()
+{
+    UInt64 now;
+    
+    clock_get_uptime(&now);
+    aspmResidency += (now - aspmStamp);
+    aspmActive = false;
+}
+
+/* AtherosE2200::aspmUpdate()
+ *
+ * Called once per timer period. Enables ASPM after aspmIdleTime idle
+ * periods and disables it again when traffic picks up. Busy polling
+ * marks the interface as latency sensitive, so ASPM stays off then.
+ */
+
+void AtherosE2200::aspmUpdate()
+{
+    UInt64 packets = hw.stats.rx_ok + hw.stats.tx_ok;
+    UInt64 delta = packets - aspmLastPackets;
+    UInt64 residency = aspmResidency;
+    UInt64 now;
+    
+    aspmLastPackets = packets;
+    
+    if (!aspmIdleTime || busyPollTime || (delta > kAspmIdlePackets)) {
+        aspmIdleCount = 0;
+        
+        if (aspmActive)
+            aspmExit();
+    } else if (!aspmActive && (++aspmIdleCount >= aspmIdleTime)) {
+        aspmEnter();
+    }
+    if (aspmActive) {
+        clock_get_uptime(&now);
+        residency += (now - aspmStamp);
+    }
+    absolutetime_to_nanoseconds(residency, &residency);
+    
+    setProperty(kAspmResidencyName, residency / 1000000, 64);
+    setProperty(kAspmEntriesName, aspmEntries, 32);
+    setProperty(kAspmExitsName, aspmExits, 32);
+}
+
+/* AtherosE2200::updatePollParams()
+ *
+ * Feed the rx activity of the last timer period into the poll controller
+ * and hand the result to the interface in case anything changed. The
+ * average rx frame size has been updated by updateStatitics() just before.
+ */
+
+void AtherosE2200::updatePollParams()
+{
+    if (tunePollParams(&pollParams, &pollStats, rxFrameStats.avgSize)) {
+        netif->setPacketPollingParameters(&pollParams, 0);
+        
+        DebugLog("Poll params: packets %u/%u, bytes %u/%u, interval %lluns.\n", pollParams.lowThresholdPackets, pollParams.highThresholdPackets, pollParams.lowThresholdBytes, pollParams.highThresholdBytes, pollParams.pollIntervalTime);
+    }
+    bzero(&pollStats, sizeof(QCAPollStats));
 }
 
 #pragma mark --- miscellaneous functions ---
@@ -2671,9 +3662,9 @@ static inline u32 ether_crc(int length, unsigned char *data)
     return crc;
 }
 
-static inline void adjustIPv4Header(mbuf_t m)
+static inline void adjustIPv4Header(UInt8 *hdr)
 {
-    struct iphdr *ipHdr = (struct iphdr *)((UInt8 *)mbuf_data(m) + ETHER_HDR_LEN);
+    struct iphdr *ipHdr = (struct iphdr *)(hdr + ETHER_HDR_LEN);
     struct tcphdr *tcpHdr = (struct tcphdr *)((UInt8 *)ipHdr + sizeof(struct iphdr));
     UInt32 plen = ntohs(ipHdr->tot_len) - sizeof(struct iphdr);
     UInt32 csum = ntohs(tcpHdr->th_sum) - plen;
@@ -2682,9 +3673,9 @@ static inline void adjustIPv4Header(mbuf_t m)
     tcpHdr->th_sum = htons((UInt16)csum);
 }
 
-static inline UInt32 adjustIPv6Header(mbuf_t m)
+static inline UInt32 adjustIPv6Header(UInt8 *hdr)
 {
-    struct ip6_hdr *ip6Hdr = (struct ip6_hdr *)((UInt8 *)mbuf_data(m) + ETHER_HDR_LEN);
+    struct ip6_hdr *ip6Hdr = (struct ip6_hdr *)(hdr + ETHER_HDR_LEN);
     struct tcphdr *tcpHdr = (struct tcphdr *)((UInt8 *)ip6Hdr + sizeof(struct ip6_hdr));
     UInt32 plen = ntohs(ip6Hdr->ip6_ctlun.ip6_un1.ip6_un1_plen);
     UInt32 csum = ntohs(tcpHdr->th_sum) - plen;
@@ -2696,3 +3687,30 @@ static inline UInt32 adjustIPv6Header(mbuf_t m)
     return (plen + kMinL4HdrOffsetV6);
 }
 
+/*
+ * Copy the ethernet, IP and TCP headers of a TSO packet into hdr.
+ * Returns the length of the headers or 0 in case they don't fit
+ * into a bounce buffer.
+ */
+static inline UInt32 copyTsoHeader(mbuf_t m, UInt8 *hdr, bool ipv6)
+{
+    struct tcphdr *tcpHdr;
+    UInt32 l4Offset = ETHER_HDR_LEN + (ipv6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr));
+    UInt32 minLen = l4Offset + sizeof(struct tcphdr);
+    UInt32 hdrLen;
+    
+    if (mbuf_copydata(m, 0, minLen, hdr))
+        return 0;
+    
+    tcpHdr = (struct tcphdr *)(hdr + l4Offset);
+    hdrLen = l4Offset + (tcpHdr->th_off << 2);
+    
+    if ((hdrLen < minLen) || (hdrLen > kTxBounceSize) || (hdrLen >= mbuf_pkthdr_len(m)))
+        return 0;
+    
+    if ((hdrLen > minLen) && mbuf_copydata(m, minLen, hdrLen - minLen, hdr + minLen))
+        return 0;
+    
+    return hdrLen;
+}
+
@@ -20,6 +20,7 @@
 
 #include "reg.h"
 #include "hw.h"
+#include "AtherosE2200Tuning.h"
 
 #ifdef DEBUG
 #define DebugLog(args...) IOLog(args)
@@ -29,6 +30,20 @@
 
 #define	RELEASE(x)	if(x){(x)->release();(x)=NULL;}
 
+/*
+ * The descriptor rings live in cacheable memory unless CONFIG_UNCACHED_DESC
+ * is defined. As PCIe DMA is cache coherent on x86, it's sufficient to
+ * order descriptor accesses at the points where ownership changes hands,
+ * i.e. before ringing a doorbell and after seeing RRD_UPDATED.
+ */
+#ifdef CONFIG_UNCACHED_DESC
+#define kDescCacheMode      kIOMapInhibitCache
+#define alxDescBarrier()    OSSynchronizeIO()
+#else
+#define kDescCacheMode      kIOMapDefaultCache
+#define alxDescBarrier()    OSMemoryBarrier()
+#endif
+
 #define alxWriteMem8(reg, val8)     _OSWriteInt8((baseAddr), (reg), (val8))
 #define alxWriteMem16(reg, val16)   OSWriteLittleInt16((baseAddr), (reg), (val16))
 #define alxWriteMem32(reg, val32)   OSWriteLittleInt32((baseAddr), (reg), (val32))
@@ -82,6 +97,14 @@ enum {
     kNumChips
 };
 
+/* Chip specific capabilities. */
+typedef struct QCAChipInfo {
+    const char *name;
+    UInt16 deviceID;
+    UInt16 eeeCap;
+    bool gbCapable;
+} QCAChipInfo;
+
 /* Transmit descriptor. */
 typedef struct QCATxDesc {
     UInt16 length;
@@ -128,6 +151,22 @@ typedef struct QCARxRetDesc {
 
 #define getProtocolID(x) ((x >> RRD_PID_SHIFT) & RRD_PID_MASK)
 
+/* The host's byte order for the descriptor helpers in AtherosE2200Tuning.h. */
+struct QCAHostOrder {
+    static inline UInt64 toLE64(UInt64 x) { return OSSwapHostToLittleInt64(x); }
+    static inline UInt64 fromLE64(UInt64 x) { return OSSwapLittleToHostInt64(x); }
+};
+
+static inline void alxStoreTxDesc(QCATxDesc *desc, UInt16 length, UInt16 vlanTag, UInt32 word1, UInt64 addr)
+{
+    txDescStore<QCAHostOrder>((volatile UInt64 *)desc, length, vlanTag, word1, addr);
+}
+
+static inline UInt64 alxLoadRxDesc(const QCARxRetDesc *desc, UInt32 i)
+{
+    return rxDescLoad<QCAHostOrder>((volatile const UInt64 *)desc, i);
+}
+
 /* PHY Specific Status Register */
 #define ALX_GIGA_PSSR_FC_RXEN   0x0004
 #define ALX_GIGA_PSSR_FC_TXEN   0x0008
@@ -138,54 +177,206 @@ typedef struct QCARxFreeDesc {
     UInt64 addr;
 } QCARxFreeDesc;
 
+/* MAC register state preserved across sleep for the resume fast path. */
+typedef struct QCARegShadow {
+    UInt32 macCtrl;
+    UInt32 hashTable[2];
+    UInt32 stationAddr[2];
+    bool captured;
+    bool valid;
+} QCARegShadow;
+
+/*
+ * The tx datapath state, split by the context writing it. Each block must
+ * fit into a cache line, so that the padding between them keeps the output
+ * thread and the work loop on separate lines.
+ */
+
+/* Written by the output thread only. */
+typedef struct QCATxProducer {
+    UInt64 paceStamp;
+    SInt64 paceTokens;
+    UInt16 nextDescIndex;
+} QCATxProducer;
+
+/*
+ * Written by both sides with atomic operations. The output thread sets
+ * probeIndex before it publishes probeStamp, the work loop clears the
+ * stamp once the probed packet has completed.
+ */
+typedef struct QCATxShared {
+    volatile UInt64 probeStamp;
+    SInt32 numFreeDesc;
+    SInt32 bytesInFlight;
+    volatile UInt32 queueLimited;
+    volatile UInt32 paceArmed;
+    UInt16 probeIndex;
+} QCATxShared;
+
+/* Written by the work loop only. */
+typedef struct QCATxConsumer {
+    UInt64 descDoneCount;
+    UInt64 descDoneLast;
+    UInt32 queueLimit;
+    UInt32 queueMinSlack;
+    UInt32 timeInFlight;
+    UInt16 dirtyDescIndex;
+} QCATxConsumer;
+
+typedef char QCATxProducerFitsLine[(sizeof(QCATxProducer) <= L1_CACHE_BYTES) ? 1 : -1];
+typedef char QCATxSharedFitsLine[(sizeof(QCATxShared) <= L1_CACHE_BYTES) ? 1 : -1];
+typedef char QCATxConsumerFitsLine[(sizeof(QCATxConsumer) <= L1_CACHE_BYTES) ? 1 : -1];
+
+/* Frame size metrics of one direction, derived from the MIB histogram. */
+typedef struct QCAFrameStats {
+    UInt64 lastPackets;
+    UInt64 lastBytes;
+    UInt64 lastSmall;
+    UInt32 avgSize;
+} QCAFrameStats;
+
+/* DMA burst and prefetch settings, see alxConfigureBasic(). */
+typedef struct QCADmaParams {
+    UInt16 txfBurst;
+    UInt8 tpdBurst;
+    UInt8 rfdPrefetch;
+    UInt8 readDelay;
+    UInt8 writeDelay;
+    UInt8 readChannels;
+} QCADmaParams;
+
+/* Number of buckets of the MIB frame size histograms. */
+#define kFrameSizeBuckets 7
+
 #define kTransmitQueueCapacity  1024
 
 /* With up to 40 segments we should be on the save side. */
 #define kMaxSegs 40
 
-/* The number of descriptors must be a power of 2. */
-#define kNumTxDesc      1024    /* Number of Tx descriptors */
-#define kNumRxDesc      512     /* Number of Rx descriptors */
-#define kTxLastDesc    (kNumTxDesc - 1)
-#define kRxLastDesc    (kNumRxDesc - 1)
-#define kTxDescMask    (kNumTxDesc - 1)
-#define kRxDescMask    (kNumRxDesc - 1)
-#define kTxDescArraySize    (kNumTxDesc*sizeof(QCATxDesc))
-#define kRxRetDescArraySize    (kNumRxDesc*sizeof(QCARxRetDesc))
-#define kRxFreeDescArraySize    (kNumRxDesc*sizeof(QCARxFreeDesc))
-#define kRxDescArraySize         (kRxRetDescArraySize + kRxFreeDescArraySize)
-#define kRxBufArraySize (kNumRxDesc * sizeof(mbuf_t))
-#define kTxBufArraySize (kNumTxDesc * sizeof(mbuf_t))
-
-/* Tx descriptor array */
-typedef struct QCATxDescArray {
-    QCATxDesc txDesc[kNumTxDesc];
-} QCATxDescArray;
-
-/* Rx descriptor array */
-typedef struct QCARxDescArray {
-    QCARxRetDesc rxRetDesc[kNumRxDesc];
-    QCARxFreeDesc rxFreeDesc[kNumRxDesc];
-} QCARxDescArray;
-
-/* This is the receive buffer size (must be exactly 2048 bytes to match a cluster). */
-#define kRxBufferPktSize 2048
+/* Per slot bounce buffer size, the upper limit of the tx copy-break. */
+#define kTxBounceSize 256
+#define kTxCopyBreakDef 128
+
+/*
+ * The number of descriptors must be a power of 2. The ring sizes can be
+ * overridden with the txRingSize and rxRingSize properties. The upper
+ * limit is given by the 12 bit buffer index of the receive return
+ * descriptor.
+ */
+#define kNumTxDescDef   1024    /* Default number of Tx descriptors */
+#define kNumRxDescDef   512     /* Default number of Rx descriptors */
+#define kNumTxDescMin   256
+#define kNumRxDescMin   64
+#define kNumDescMax     4096
+
+/*
+ * All descriptor rings are carved out of a single DMA region, the
+ * descriptor arena. These are the alignments of the ring base addresses.
+ */
+#define kTxDescAlign        256
+#define kRxRetDescAlign     4096
+#define kRxFreeDescAlign    8
+
 #define kRxNumSpareMbufs 100
+
+/*
+ * setupRxResources() posts only kRxInitialFill receive buffers. The rest
+ * of the ring is populated in steps of kRxFillStep once the interface
+ * is running.
+ */
+#define kRxInitialFill 64
+#define kRxFillStep 32
 #define kMCFilterLimit 32
 #define kMaxRxQueques 1
 #define kMaxMtu 9000
 #define kMaxPacketSize (kMaxMtu + ETH_HLEN + ETH_FCS_LEN)
 #define kMaxTsoMtu 7000
 
+/*
+ * MSI-X vector assignment: misc/PHY causes, rx queue 0 and tx queue 0
+ * are delivered through separate vectors.
+ */
+enum
+{
+    kMSIXVectorMisc = 0,
+    kMSIXVectorRx,
+    kMSIXVectorTx,
+    kNumMSIXVectors
+};
+
+#ifndef kIOInterruptTypePCIMessagedX
+#define kIOInterruptTypePCIMessagedX 0x00020000
+#endif
+
+#define kQueueIntrMask (ALX_ISR_RX_Q0 | ALX_ISR_TX_Q0)
+
+/* Default number of rx packets and tx descriptors handled per pass. */
+#define kRxBudgetDef 64
+#define kTxBudgetDef 256
+#define kBudgetMin 8
+
+/*
+ * Busy polling may spin for at most kBusyPollBudgetUS per timer period.
+ * After kBusyPollBackoff misses in a row the spin time is halved. As the
+ * spin blocks the work loop, a single spin is limited to kBusyPollMaxUS.
+ */
+#define kBusyPollMaxUS      100
+#define kBusyPollBudgetUS   100000
+#define kBusyPollBackoff    8
+
+/*
+ * ASPM governor: L1 is entered after aspmIdleTime timer periods with at
+ * most kAspmIdlePackets packets each and left as soon as a single service
+ * pass handles kAspmBurstPackets or more.
+ */
+#define kAspmIdlePackets    50
+#define kAspmBurstPackets   16
+#define kAspmIdleTimeDef    5
+#define kAspmIdleTimeMax    3600
+
+/*
+ * LPI controller: the decision timer follows the mean inter-packet gap of
+ * the last timer period, short gaps need a long timer to keep the link
+ * from bouncing in and out of LPI. LPI is suspended while the mean gap is
+ * below kLpiGapMinUS or busy polling is enabled. The wake times are
+ * Tw_sys_tx of 802.3az for 1000BASE-T and 100BASE-TX.
+ */
+#define kLpiGapMinUS        50
+#define kLpiGapIdleUS       10000
+#define kLpiDecisnMinUS     20
+#define kLpiDecisnMaxUS     1000
+#define kLpiWait1000US      17
+#define kLpiWait100US       30
+
+/*
+ * Rx flow control: the pause high watermark leaves room for one frame of
+ * ours and one of the link partner plus the pause frame and link delay.
+ * FIFO overflows raise the headroom by kFcStep, pause storms and
+ * kFcDecayPeriods quiet timer periods lower it again.
+ */
+#define kFcLinkOverhead     168
+#define kFcStep             512
+#define kFcPauseStorm       1000
+#define kFcDecayPeriods     60
+
 /* statitics timer period in ms. */
 #define kTimeoutMS 1000
 
-/* Treshhold value to wake a stalled queue */
-#define kTxQueueWakeTreshhold (kNumTxDesc / 4)
+/* Treshhold value to wake a stalled queue (fraction of the tx ring) */
+#define kTxQueueWakeShift 2
 
 /* transmitter deadlock treshhold in seconds. */
 #define kTxDeadlockTreshhold 5
 
+/*
+ * Limits of the byte based tx queue limit. The limit grows when the
+ * hardware runs dry while packets were held back and shrinks by the
+ * unused slack once per timer period.
+ */
+#define kTxQueueLimitMin    (2 * kMaxPacketSize)
+#define kTxQueueLimitMax    (4 * 1024 * 1024)
+#define kTxQueueSlackNone   0xFFFFFFFF
+
 /* IP specific stuff */
 #define kMinL4HdrOffsetV4 34
 #define kMinL4HdrOffsetV6 54
@@ -231,13 +422,62 @@ enum
 };
 
 #define kEnableCSO6Name "enableCSO6"
+#define kEnableSleepProxyName "enableSleepProxy"
+#define kSynWakePortsName "synWakePorts"
 #define kEnableTSO4Name "enableTSO4"
 #define kEnableTSO6Name "enableTSO6"
 #define kIntrRateName "maxIntrRate"
+#define kTxIntrRateName "maxTxIntrRate"
+#define kEnableMSIXName "enableMSIX"
+#define kRxBudgetName "rxBudget"
+#define kTxBudgetName "txBudget"
+#define kBusyPollName "busyPollUS"
+#define kBusyPollHitsName "BusyPollHits"
+#define kBusyPollMissesName "BusyPollMisses"
 #define kDriverVersionName "Driver_Version"
 #define kNameLenght 64
 
 #define kEnableRxPollName "rxPolling"
+#define kAdaptivePollName "adaptivePolling"
+#define kAdaptiveLpiName "adaptiveLPI"
+#define kLpiDecisnTimerName "LpiDecisionTimerUS"
+#define kLpiWakeupsName "LpiWakeups"
+#define kLpiLatencyName "LpiAddedLatencyUS"
+#define kDmaReadChannelsName "dmaReadChannels"
+#define kDmaReadDelayName "dmaReadDelay"
+#define kDmaWriteDelayName "dmaWriteDelay"
+#define kRfdPrefetchName "rfdPrefetch"
+#define kTpdBurstName "tpdBurstPrefetch"
+#define kTxfBurstName "txfBurstPrefetch"
+#define kAspmIdleTimeName "aspmIdleTime"
+#define kFcHighWatermarkName "FcHighWatermark"
+#define kFcLowWatermarkName "FcLowWatermark"
+#define kFcFastPauseName "FcFastPause"
+#define kFcAdjustmentsName "FcAdjustments"
+#define kRxFifoOverflowsName "RxFifoOverflows"
+#define kFcPauseRxName "PauseFramesRx"
+#define kFcPauseTxName "PauseFramesTx"
+#define kAspmL0sName "aspmL0s"
+#define kAspmResidencyName "AspmResidencyMS"
+#define kAspmEntriesName "AspmEntries"
+#define kAspmExitsName "AspmExits"
+#define kAspmExitLatencyMaxName "AspmL1ExitLatencyMaxUS"
+#define kTxRingSizeName "txRingSize"
+#define kRxRingSizeName "rxRingSize"
+#define kEnableFastResumeName "fastResume"
+#define kResumeLatencyName "ResumeFirstPacketMS"
+#define kRxRingReadyName "RxRingReadyUS"
+#define kRxRingFullName "RxRingFullMS"
+#define kRxFrameSizesName "RxFrameSizes"
+#define kTxFrameSizesName "TxFrameSizes"
+#define kRxFrameAvgName "RxFrameSizeAvg"
+#define kTxFrameAvgName "TxFrameSizeAvg"
+#define kRxSmallFramesName "RxSmallFramesPercent"
+#define kTxSmallFramesName "TxSmallFramesPercent"
+#define kTxQueueLimitName "TxQueueLimit"
+#define kTxPaceRateName "txPacingRate"
+#define kTxCopyBreakName "txCopyBreak"
+#define kTxTimeInFlightName "TxTimeInFlightUS"
 
 class AtherosE2200 : public super
 {
@@ -296,17 +536,43 @@ private:
     bool alxResetPCIe();
     static IOReturn setPowerStateWakeAction(OSObject *owner, void *arg1, void *arg2, void *arg3, void *arg4);
     static IOReturn setPowerStateSleepAction(OSObject *owner, void *arg1, void *arg2, void *arg3, void *arg4);
+    void reportResumeLatency();
     void getParams(UInt32 *intrLimit);
+    UInt32 getRingSizeParam(const char *name, UInt32 defSize, UInt32 minSize);
+    UInt32 getDmaParam(const char *name, UInt32 defValue, UInt32 minValue, UInt32 maxValue);
     bool setupMediumDict();
     bool initEventSources(IOService *provider);
+    bool initMSIXSources(IOService *provider);
     void interruptOccurred(OSObject *client, IOInterruptEventSource *src, int count);
-    void txInterrupt();
+    void rxVectorOccurred(OSObject *client, IOInterruptEventSource *src, int count);
+    void txVectorOccurred(OSObject *client, IOInterruptEventSource *src, int count);
+    bool txInterrupt(UInt32 budget);
+    void serviceQueues();
+    bool busyPoll();
+    void serviceAction(OSObject *client, IOInterruptEventSource *src, int count);
+    void lpiSetState(bool enable);
+    void lpiUpdate();
+    void aspmEnter();
+    void aspmExit();
+    void aspmStop();
+    void aspmUpdate();
+    void txQueueCompleted(UInt32 bytes);
+    void txQueueAdjustLimit();
+    bool txPaceRefill();
+    void txPaceAction(IOTimerEventSource *timer);
     
     UInt32 rxInterrupt(IONetworkInterface *interface, uint32_t maxCount, IOMbufQueue *pollQueue, void *context);
 
+    bool setupDescArena();
+    void *allocDescRange(IOByteCount size, IOByteCount align, IOPhysicalAddress64 *phyAddr);
+    void freeDescArena();
     bool setupRxResources();
     bool setupTxResources();
+    void setupTxBounceBuffers();
     void refillSpareBuffers();
+    void growRxRing(UInt32 count);
+    void reportRxRingFull();
+    bool resizeRxBuffers();
     
     static IOReturn refillAction(OSObject *owner, void *arg1, void *arg2, void *arg3, void *arg4);
     
@@ -315,6 +581,8 @@ private:
     void clearDescriptors();
     void checkLinkStatus();
     void updateStatitics();
+    void updateFrameStats(QCAFrameStats *stats, const UInt64 *sizes, UInt64 bytes, const char *histName, const char *avgName, const char *smallName);
+    void updatePollParams();
     void setLinkUp();
     void setLinkDown();
     bool checkForDeadlock();
@@ -324,13 +592,19 @@ private:
     bool alxLoadDefaultAddress();
     bool alxStart(UInt32 maxIntrRate);
     void alxEnable();
+    bool alxResume();
     int alxDisable();
     void alxRestart();
     bool alxIdentifyChip();
     void alxInitDescRings();
     void alxConfigure();
     void alxConfigureBasic();
+    void alxSetFlowCtrlThresholds();
+    void fcUpdate();
     void alxConfigureRSS(bool enable);
+    void alxConfigureMSI();
+    void alxSaveRegShadow();
+    void alxRestoreRegShadow();
     inline void alxEnableIRQ();
     inline void alxDisableIRQ();
     inline void alxGetChkSumCommand(UInt32 *cmd, mbuf_csum_request_flags_t checksums);
@@ -339,6 +613,7 @@ private:
     void alxPostPhyLink();
     int alxSetupSpeedDuplex(UInt32 ethadv, UInt16 eeeadv, UInt8 flowctrl);
     int alxSelectPowersavingSpeed(int *speed, UInt8 *duplex);
+    void alxConfigSleepProxy();
     void alxSpeedDuplexForMedium(const IONetworkMedium *medium);
     IOReturn alxActiveMediumIndex(UInt32 *index);
 
@@ -354,41 +629,49 @@ private:
 	IOBasicOutputQueue *txQueue;
 	
 	IOInterruptEventSource *interruptSource;
+	IOInterruptEventSource *rxIntrSource;
+	IOInterruptEventSource *txIntrSource;
+	IOInterruptEventSource *serviceSource;
 	IOTimerEventSource *timerSource;
+	IOTimerEventSource *paceTimerSource;
 	IOEthernetInterface *netif;
 	IOMemoryMap *baseMap;
     IOMapper *mapper;
     volatile void *baseAddr;
     
-    /* transmitter data */
-    IOBufferMemoryDescriptor *txBufDesc;
+    /* descriptor arena, shared by all rings */
+    IOBufferMemoryDescriptor *descArenaDesc;
+    IODMACommand *descArenaDmaCmd;
+    UInt8 *descArena;
+    IOPhysicalAddress64 descArenaPhyAddr;
+    IOByteCount descArenaSize;
+    IOByteCount descArenaUsed;
+    
+    /* transmitter data, read-mostly */
     IOPhysicalAddress64 txPhyAddr;
-    IODMACommand *txDescDmaCmd;
     QCATxDesc *txDescArray;
     IOMbufNaturalMemoryCursor *txMbufCursor;
     mbuf_t *txMbufArray;
     void *txBufArrayMem;
-    UInt64 txDescDoneCount;
-    UInt64 txDescDoneLast;
-    SInt32 txNumFreeDesc;
-    UInt16 txNextDescIndex;
-    UInt16 txDirtyDescIndex;
+    UInt32 numTxDesc;
+    UInt32 txDescMask;
+    UInt32 txWakeThreshold;
+    UInt32 txPaceRate;
+    IOBufferMemoryDescriptor *txBounceDesc;
+    IODMACommand *txBounceDmaCmd;
+    UInt8 *txBounceArray;
+    IOPhysicalAddress64 txBouncePhyAddr;
+    UInt32 txCopyBreak;
     
-    /* receiver data */
-    IOBufferMemoryDescriptor *rxBufDesc;
+    /* receiver data, read-mostly */
     IOPhysicalAddress64 rxRetPhyAddr;
     IOPhysicalAddress64 rxFreePhyAddr;
-    IODMACommand *rxDescDmaCmd;
-    QCARxRetDesc *rxRetDescArray;
-    QCARxFreeDesc *rxFreeDescArray;
-	IOMbufNaturalMemoryCursor *rxMbufCursor;
-    mbuf_t sparePktHead;
-    mbuf_t sparePktTail;
-    mbuf_t *rxMbufArray;
     void *rxBufArrayMem;
-    SInt32 spareNum;
+    UInt64 rxFillStamp;
+    volatile UInt32 rxFillCount;
+    UInt32 numRxDesc;
+    UInt32 rxBufferSizeNew;
     UInt32 multicastFilter[2];
-    UInt16 rxNextDescIndex;
     
     /* EEE support */
     UInt16 eeeCap;
@@ -398,6 +681,8 @@ private:
     
     /* power management data */
     unsigned long powerState;
+    QCARegShadow regShadow;
+    UInt64 resumeStamp;
     
     /* statistics data */
     UInt32 deadlockWarn;
@@ -406,8 +691,59 @@ private:
     
     UInt32 chip;
     UInt32 intrMask;
+    UInt32 txIntrRate;
+    UInt32 rxBudget;
+    UInt32 txBudget;
+    
+    /* busy polling */
+    UInt32 busyPollTime;
+    UInt32 busyPollCur;
+    UInt32 busyPollSpent;
+    UInt32 busyPollMissRun;
+    UInt32 busyPollHits;
+    UInt32 busyPollMisses;
+    UInt8 chipRev;
+    
+    /* LPI controller */
+    UInt64 lpiLastPackets;
+    UInt64 lpiWakeups;
+    UInt64 lpiLatency;
+    UInt32 lpiBursts;
+    UInt32 lpiDecisnTimer;
+    UInt32 lpiWaitTimer;
+    bool lpiActive;
+    bool adaptiveLpi;
+    
+    QCADmaParams dmaParams;
+    
+    /* rx flow control */
+    UInt64 fcLastOverflows;
+    UInt64 fcLastTxPause;
+    UInt32 rxFifoSize;
+    UInt32 fcReserveExtra;
+    UInt32 fcHighWatermark;
+    UInt32 fcLowWatermark;
+    UInt32 fcQuietPeriods;
+    UInt32 fcAdjustments;
+    bool fcFastPause;
+    
+    /* ASPM governor */
+    UInt64 aspmLastPackets;
+    UInt64 aspmStamp;
+    UInt64 aspmResidency;
+    UInt32 aspmIdleTime;
+    UInt32 aspmIdleCount;
+    UInt32 aspmEntries;
+    UInt32 aspmExits;
+    bool aspmActive;
+    bool aspmL0s;
     
     IONetworkPacketPollingParameters pollParams;
+    QCAPollStats pollStats;
+    QCAFrameStats rxFrameStats;
+    QCAFrameStats txFrameStats;
+    
+    UInt16 synWakePort;
 
     struct alx_hw hw;
     struct pci_dev pciDeviceData;
@@ -425,13 +761,19 @@ private:
     
     bool rxPoll;
     bool polling;
+    bool adaptivePoll;
+    
+    bool fastResume;
+    bool wakeFromSleep;
     
     bool useMSI;
+    bool useMSIX;
     bool gbCapable;;
     bool wolCapable;
     bool enableTSO4;
     bool enableTSO6;
     bool enableCSO6;
+    bool sleepProxy;
         
 #ifdef CONFIG_RSS
     
@@ -443,4 +785,30 @@ private:
 	UInt8 rssBaseCPU;
 
 #endif  /* CONFIG_RSS */
+    
+    /*
+     * Datapath state is kept at the end of the object, grouped by the
+     * context writing it. As an OSObject's storage isn't cache line
+     * aligned, the groups are separated by a cache line of padding, so
+     * that the output thread and the work loop never write to the same
+     * line unless they share a variable.
+     */
+    UInt8 txProducerPad[L1_CACHE_BYTES];
+    QCATxProducer txProducer;
+    UInt8 txSharedPad[L1_CACHE_BYTES];
+    QCATxShared txShared;
+    UInt8 txConsumerPad[L1_CACHE_BYTES];
+    QCATxConsumer txConsumer;
+    
+    /* receiver, written by the work loop or the poll thread */
+    QCARxRetDesc *rxRetDescArray;
+    QCARxFreeDesc *rxFreeDescArray;
+    mbuf_t *rxMbufArray;
+    IOMbufNaturalMemoryCursor *rxMbufCursor;
+    mbuf_t sparePktHead;
+    mbuf_t sparePktTail;
+    SInt32 spareNum;
+    UInt32 rxDescMask;
+    UInt32 rxBufferSize;
+    UInt16 rxNextDescIndex;
 };
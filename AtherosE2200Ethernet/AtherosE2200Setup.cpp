@@ -115,6 +115,11 @@ bool AtherosE2200::initEventSources(IOService *provider)
     }
     txQueue->retain();
     
+    if (useMSIX && initMSIXSources(provider))
+        goto timer;
+    
+    useMSIX = false;
+    
     while ((intrResult = pciDevice->getInterruptType(intrIndex, &intrType)) == kIOReturnSuccess) {
         if (intrType & kIOInterruptTypePCIMessaged){
             msiIndex = intrIndex;
@@ -151,23 +156,55 @@ bool AtherosE2200::initEventSources(IOService *provider)
     if (!useMSI)
         interruptSource->enable();
     
+timer:
+    serviceSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &AtherosE2200::serviceAction));
+    
+    if (!serviceSource) {
+        IOLog("Failed to create service event source.\n");
+        goto error2;
+    }
+    workLoop->addEventSource(serviceSource);
+    
     timerSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &AtherosE2200::timerAction));
     
     if (!timerSource) {
         IOLog("Failed to create IOTimerEventSource.\n");
-        goto error2;
+        goto error4;
     }
     workLoop->addEventSource(timerSource);
     
+    paceTimerSource = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &AtherosE2200::txPaceAction));
+    
+    if (!paceTimerSource) {
+        IOLog("Failed to create pacing IOTimerEventSource.\n");
+        goto error3;
+    }
+    workLoop->addEventSource(paceTimerSource);
+    
     result = true;
     
 done:
     return result;
     
+error3:
+    workLoop->removeEventSource(timerSource);
+    RELEASE(timerSource);
+    
+error4:
+    workLoop->removeEventSource(serviceSource);
+    RELEASE(serviceSource);
+    
 error2:
     workLoop->removeEventSource(interruptSource);
     RELEASE(interruptSource);
     
+    if (useMSIX) {
+        workLoop->removeEventSource(txIntrSource);
+        RELEASE(txIntrSource);
+        workLoop->removeEventSource(rxIntrSource);
+        RELEASE(rxIntrSource);
+    }
+    
 error1:
     IOLog("Error initializing event sources.\n");
     txQueue->release();
@@ -175,72 +212,213 @@ error1:
     goto done;
 }
 
-bool AtherosE2200::setupRxResources()
+/*
+ * Allocate one event source per MSI-X vector. The tx source is added to the
+ * work loop ahead of the rx source, so that pending completions are
+ * reclaimed first when both vectors fire at the same time.
+ */
+bool AtherosE2200::initMSIXSources(IOService *provider)
+{
+    int msixIndex = -1;
+    int intrIndex = 0;
+    int intrType = 0;
+    
+    while (pciDevice->getInterruptType(intrIndex, &intrType) == kIOReturnSuccess) {
+        if (intrType & kIOInterruptTypePCIMessagedX) {
+            msixIndex = intrIndex;
+            break;
+        }
+        intrIndex++;
+    }
+    if (msixIndex == -1) {
+        IOLog("MSI-X isn't available. Falling back to a single vector.\n");
+        goto error1;
+    }
+    interruptSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &AtherosE2200::interruptOccurred), provider, msixIndex + kMSIXVectorMisc);
+    txIntrSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &AtherosE2200::txVectorOccurred), provider, msixIndex + kMSIXVectorTx);
+    rxIntrSource = IOInterruptEventSource::interruptEventSource(this, OSMemberFunctionCast(IOInterruptEventSource::Action, this, &AtherosE2200::rxVectorOccurred), provider, msixIndex + kMSIXVectorRx);
+
+    if (!interruptSource || !txIntrSource || !rxIntrSource) {
+        IOLog("Failed to allocate MSI-X event sources. Falling back to a single vector.\n");
+        goto error2;
+    }
+    workLoop->addEventSource(txIntrSource);
+    workLoop->addEventSource(rxIntrSource);
+    workLoop->addEventSource(interruptSource);
+    useMSI = true;
+
+    DebugLog("MSI-X interrupt index: %d\n", msixIndex);
+
+    return true;
+    
+error2:
+    RELEASE(interruptSource);
+    RELEASE(txIntrSource);
+    RELEASE(rxIntrSource);
+    
+error1:
+    return false;
+}
+
+/* AtherosE2200::setupDescArena()
+ *
+ * Allocate one DMA region for all descriptor rings. The rings are carved
+ * out of it with allocDescRange() so that there is only a single mapping
+ * to set up. The NIC takes only one upper 32 bit address per direction,
+ * therefore the region must not cross a 4GB boundary.
+ */
+
+bool AtherosE2200::setupDescArena()
 {
-    IOPhysicalSegment rxSegment;
     IODMACommand::Segment64 seg;
-    QCARxDescArray *descArray;
-    mbuf_t m;
+    QCADescRange ranges[3];
     UInt64 offset = 0;
     UInt32 numSegs = 1;
-    UInt32 i;
     bool result = false;
     
-    /* Alloc rx mbuf_t array. */
-    rxBufArrayMem = IOMallocZero(kRxBufArraySize);
+    /* Reserve space for the rings in the order they are allocated. */
+    ranges[0].size = numTxDesc * sizeof(QCATxDesc);
+    ranges[0].align = kTxDescAlign;
+    ranges[1].size = numRxDesc * sizeof(QCARxRetDesc);
+    ranges[1].align = kRxRetDescAlign;
+    ranges[2].size = numRxDesc * sizeof(QCARxFreeDesc);
+    ranges[2].align = kRxFreeDescAlign;
     
-    if (!rxBufArrayMem) {
-        IOLog("Couldn't alloc receive buffer array.\n");
-        goto done;
-    }
-    rxMbufArray = (mbuf_t *)rxBufArrayMem;
-
-    /* Create receiver descriptor array. */
-    rxBufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous | kIOMapInhibitCache), kRxDescArraySize, 0xFFFFFFFFFFFFF000ULL);
+    descArenaSize = descArenaLayoutSize(ranges, 3);
+    descArenaUsed = 0;
     
-    if (!rxBufDesc) {
-        IOLog("Couldn't alloc rxBufDesc.\n");
-        goto error_buff;
+    descArenaDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous | kDescCacheMode), descArenaSize, 0xFFFFFFFFFFFFF000ULL);
+    
+    if (!descArenaDesc) {
+        IOLog("Couldn't alloc descArenaDesc.\n");
+        goto done;
     }
-    if (rxBufDesc->prepare() != kIOReturnSuccess) {
-        IOLog("rxBufDesc->prepare() failed.\n");
+    if (descArenaDesc->prepare() != kIOReturnSuccess) {
+        IOLog("descArenaDesc->prepare() failed.\n");
         goto error_prep;
     }
-
-    rxDescDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
+    descArena = (UInt8 *)descArenaDesc->getBytesNoCopy();
+    
+    descArenaDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
     
-    if (!rxDescDmaCmd) {
-        IOLog("Couldn't alloc rxDescDmaCmd.\n");
+    if (!descArenaDmaCmd) {
+        IOLog("Couldn't alloc descArenaDmaCmd.\n");
         goto error_dma;
     }
-    
-    if (rxDescDmaCmd->setMemoryDescriptor(rxBufDesc) != kIOReturnSuccess) {
+    if (descArenaDmaCmd->setMemoryDescriptor(descArenaDesc) != kIOReturnSuccess) {
         IOLog("setMemoryDescriptor() failed.\n");
         goto error_set_desc;
     }
-    
-    if (rxDescDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
+    if (descArenaDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
         IOLog("gen64IOVMSegments() failed.\n");
         goto error_segm;
     }
-    /* And the rx ring's physical address too. */
-    rxRetPhyAddr = seg.fIOVMAddr;
+    descArenaPhyAddr = seg.fIOVMAddr;
+    
+    if (descArenaCrosses4GB(descArenaPhyAddr, descArenaSize)) {
+        IOLog("Descriptor arena crosses a 4GB boundary.\n");
+        goto error_segm;
+    }
+    bzero(descArena, descArenaSize);
+    DebugLog("Descriptor arena: %llu bytes at 0x%llx.\n", (UInt64)descArenaSize, descArenaPhyAddr);
+    result = true;
+    
+done:
+    return result;
+    
+error_segm:
+    descArenaDmaCmd->clearMemoryDescriptor();
     
-    /* Setup receiver return descriptor array. */
-    descArray = (QCARxDescArray *)rxBufDesc->getBytesNoCopy();
-    rxRetDescArray = &descArray->rxRetDesc[0];
+error_set_desc:
+    RELEASE(descArenaDmaCmd);
     
-    /* Initialize rxRetDescArray. */
-    bzero(rxRetDescArray, kRxRetDescArraySize);
+error_dma:
+    descArenaDesc->complete();
+    
+error_prep:
+    RELEASE(descArenaDesc);
+    descArena = NULL;
+    goto done;
+}
 
-    /* Setup receiver free descriptor array. */
-    rxFreeDescArray =&descArray->rxFreeDesc[0];
-    rxFreePhyAddr = rxRetPhyAddr + offsetof(QCARxDescArray, rxFreeDesc);
+/* AtherosE2200::allocDescRange()
+ *
+ * Hand out size bytes of the descriptor arena aligned to align, which
+ * must be a power of 2 not larger than a page. Ranges are never given
+ * back, they are released together with the arena.
+ */
+
+void *AtherosE2200::allocDescRange(IOByteCount size, IOByteCount align, IOPhysicalAddress64 *phyAddr)
+{
+    UInt64 start;
+    void *addr = NULL;
+    
+    if (!descArena || !descRangeFit(descArenaUsed, size, align, descArenaSize, &start)) {
+        IOLog("Descriptor arena exhausted.\n");
+        goto done;
+    }
+    addr = descArena + start;
+    *phyAddr = descArenaPhyAddr + start;
+    descArenaUsed = start + size;
     
-    /* Initialize rxFreeDescArray. */
-    bzero(rxFreeDescArray, kRxFreeDescArraySize);
+done:
+    return addr;
+}
 
-    for (i = 0; i < kNumRxDesc; i++) {
+void AtherosE2200::freeDescArena()
+{
+    if (descArenaDmaCmd) {
+        descArenaDmaCmd->complete();
+        descArenaDmaCmd->clearMemoryDescriptor();
+        RELEASE(descArenaDmaCmd);
+    }
+    if (descArenaDesc) {
+        descArenaDesc->complete();
+        RELEASE(descArenaDesc);
+    }
+    descArena = NULL;
+    descArenaPhyAddr = (IOPhysicalAddress64)NULL;
+    descArenaSize = descArenaUsed = 0;
+}
+
+bool AtherosE2200::setupRxResources()
+{
+    IOPhysicalSegment rxSegment;
+    IOByteCount retArraySize = numRxDesc * sizeof(QCARxRetDesc);
+    IOByteCount freeArraySize = numRxDesc * sizeof(QCARxFreeDesc);
+    mbuf_t m;
+    UInt64 now, delta;
+    UInt32 fill = (numRxDesc < kRxInitialFill) ? numRxDesc : kRxInitialFill;
+    UInt32 i;
+    bool result = false;
+    
+    clock_get_uptime(&rxFillStamp);
+
+    /* Alloc rx mbuf_t array. */
+    rxBufArrayMem = IOMallocZero(numRxDesc * sizeof(mbuf_t));
+    
+    if (!rxBufArrayMem) {
+        IOLog("Couldn't alloc receive buffer array.\n");
+        goto done;
+    }
+    rxMbufArray = (mbuf_t *)rxBufArrayMem;
+
+    /* Carve the receiver return and free descriptor arrays out of the arena. */
+    rxRetDescArray = (QCARxRetDesc *)allocDescRange(retArraySize, kRxRetDescAlign, &rxRetPhyAddr);
+    
+    if (!rxRetDescArray)
+        goto error_buff;
+    
+    rxFreeDescArray = (QCARxFreeDesc *)allocDescRange(freeArraySize, kRxFreeDescAlign, &rxFreePhyAddr);
+    
+    if (!rxFreeDescArray)
+        goto error_buff;
+
+    /* Initialize both arrays. */
+    bzero(rxRetDescArray, retArraySize);
+    bzero(rxFreeDescArray, freeArraySize);
+
+    for (i = 0; i < numRxDesc; i++) {
         rxMbufArray[i] = NULL;
     }
     rxNextDescIndex = 0;
@@ -249,12 +427,15 @@ bool AtherosE2200::setupRxResources()
     
     if (!rxMbufCursor) {
         IOLog("Couldn't create rxMbufCursor.\n");
-        goto error_segm;
+        goto error_buff;
     }
 
-    /* Alloc receive buffers. */
-    for (i = 0; i < kNumRxDesc; i++) {
-        m = allocatePacket(kRxBufferPktSize);
+    /*
+     * Alloc the initial window of receive buffers. The remaining
+     * descriptors are populated by growRxRing() later on.
+     */
+    for (i = 0; i < fill; i++) {
+        m = allocatePacket(rxBufferSize);
         
         if (!m) {
             IOLog("Couldn't alloc receive buffer.\n");
@@ -268,35 +449,27 @@ bool AtherosE2200::setupRxResources()
         }
         rxFreeDescArray[i].addr = OSSwapHostToLittleInt64(rxSegment.location);
     }
+    rxFillCount = fill;
 
     /*
-     * Allocate some spare mbufs and keep them in a buffer pool, to
-     * have them at hand in case replaceOrCopyPacket() fails
-     * under heavy load.
+     * The pool of spare mbufs, which are kept at hand in case
+     * replaceOrCopyPacket() fails under heavy load, is filled
+     * by refillSpareBuffers() once packets are flowing.
      */
     sparePktHead = sparePktTail = NULL;
+    spareNum = 0;
 
-    for (i = 0; i < kRxNumSpareMbufs; i++) {
-        m = allocatePacket(kRxBufferPktSize);
-        
-        if (m) {
-            if (sparePktHead) {
-                mbuf_setnext(sparePktTail, m);
-                sparePktTail = m;
-                spareNum++;
-            } else {
-                sparePktHead = sparePktTail = m;
-                spareNum = 1;
-            }
-        }
-    }
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - rxFillStamp, &delta);
+    setProperty(kRxRingReadyName, (UInt32)(delta / 1000), 32);
+    DebugLog("Posted %u of %u rx buffers in %llu us.\n", fill, numRxDesc, delta / 1000);
     result = true;
     
 done:
     return result;
     
 error_buf:
-    for (i = 0; i < kNumRxDesc; i++) {
+    for (i = 0; i < numRxDesc; i++) {
         if (rxMbufArray[i]) {
             freePacket(rxMbufArray[i]);
             rxMbufArray[i] = NULL;
@@ -304,20 +477,10 @@ error_buf:
     }
     RELEASE(rxMbufCursor);
 
-error_segm:
-    rxDescDmaCmd->clearMemoryDescriptor();
-
-error_set_desc:
-    RELEASE(rxDescDmaCmd);
-
-error_dma:
-    rxBufDesc->complete();
-    
-error_prep:
-    RELEASE(rxBufDesc);
-
 error_buff:
-    IOFree(rxBufArrayMem, kRxBufArraySize);
+    rxRetDescArray = NULL;
+    rxFreeDescArray = NULL;
+    IOFree(rxBufArrayMem, numRxDesc * sizeof(mbuf_t));
     rxBufArrayMem = NULL;
     rxMbufArray = NULL;
 
@@ -326,14 +489,11 @@ error_buff:
 
 bool AtherosE2200::setupTxResources()
 {
-    IODMACommand::Segment64 seg;
-    UInt64 offset = 0;
-    UInt32 numSegs = 1;
     UInt32 i;
     bool result = false;
     
     /* Alloc tx mbuf_t array. */
-    txBufArrayMem = IOMallocZero(kTxBufArraySize);
+    txBufArrayMem = IOMallocZero(numTxDesc * sizeof(mbuf_t));
     
     if (!txBufArrayMem) {
         IOLog("Couldn't alloc transmit buffer array.\n");
@@ -341,71 +501,36 @@ bool AtherosE2200::setupTxResources()
     }
     txMbufArray = (mbuf_t *)txBufArrayMem;
     
-    /* Create transmitter descriptor array. */
-    txBufDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionInOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous | kIOMapInhibitCache), kTxDescArraySize, 0xFFFFFFFFFFFFFF00ULL);
-                
-    if (!txBufDesc) {
-        IOLog("Couldn't alloc txBufDesc.\n");
-        goto error_buff;
-    }
-    if (txBufDesc->prepare() != kIOReturnSuccess) {
-        IOLog("txBufDesc->prepare() failed.\n");
-        goto error_prep;
-    }
-    txDescArray = (QCATxDesc *)txBufDesc->getBytesNoCopy();
-
-    txDescDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
+    /* Carve the transmitter descriptor array out of the arena. */
+    txDescArray = (QCATxDesc *)allocDescRange(numTxDesc * sizeof(QCATxDesc), kTxDescAlign, &txPhyAddr);
     
-    if (!txDescDmaCmd) {
-        IOLog("Couldn't alloc txDescDmaCmd.\n");
-        goto error_dma;
-    }
-    
-    if (txDescDmaCmd->setMemoryDescriptor(txBufDesc) != kIOReturnSuccess) {
-        IOLog("setMemoryDescriptor() failed.\n");
-        goto error_set_desc;
-    }
-    
-    if (txDescDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
-        IOLog("gen64IOVMSegments() failed.\n");
-        goto error_segm;
-    }
-    /* Now get tx ring's physical address. */
-    txPhyAddr = seg.fIOVMAddr;
+    if (!txDescArray)
+        goto error_buff;
     
     /* Initialize txDescArray. */
-    bzero(txDescArray, kTxDescArraySize);
+    bzero(txDescArray, numTxDesc * sizeof(QCATxDesc));
     
-    for (i = 0; i < kNumTxDesc; i++) {
+    for (i = 0; i < numTxDesc; i++) {
         txMbufArray[i] = NULL;
     }
-    txNextDescIndex = txDirtyDescIndex = 0;
-    txNumFreeDesc = kNumTxDesc;
+    txProducer.nextDescIndex = txConsumer.dirtyDescIndex = 0;
+    txShared.numFreeDesc = numTxDesc;
     txMbufCursor = IOMbufNaturalMemoryCursor::withSpecification(0x1000, kMaxSegs);
 
     if (!txMbufCursor) {
         IOLog("Couldn't create txMbufCursor.\n");
-        goto error_segm;
+        goto error_buff;
     }
+    setupTxBounceBuffers();
+    
     result = true;
     
 done:
     return result;
     
-error_segm:
-    txDescDmaCmd->clearMemoryDescriptor();
-
-error_set_desc:
-    RELEASE(txDescDmaCmd);
-    
-error_dma:
-    txBufDesc->complete();
-
-error_prep:
-    RELEASE(txBufDesc);
-    
 error_buff:
-    IOFree(txBufArrayMem, kTxBufArraySize);
+    txDescArray = NULL;
+    IOFree(txBufArrayMem, numTxDesc * sizeof(mbuf_t));
     txBufArrayMem = NULL;
     txMbufArray = NULL;
     
@@ -416,32 +541,29 @@ void AtherosE2200::freeRxResources()
 {
     UInt32 i;
     
-    if (rxDescDmaCmd) {
-        rxDescDmaCmd->complete();
-        rxDescDmaCmd->clearMemoryDescriptor();
-        rxDescDmaCmd->release();
-        rxDescDmaCmd = NULL;
-    }
-    if (rxBufDesc) {
-        rxBufDesc->complete();
-        rxBufDesc->release();
-        rxBufDesc = NULL;;
-        rxRetPhyAddr = (IOPhysicalAddress64)NULL;
-        rxFreePhyAddr = (IOPhysicalAddress64)NULL;
-    }
+    /* The descriptor arrays are released with the arena. */
+    rxRetDescArray = NULL;
+    rxFreeDescArray = NULL;
+    rxRetPhyAddr = (IOPhysicalAddress64)NULL;
+    rxFreePhyAddr = (IOPhysicalAddress64)NULL;
+
     RELEASE(rxMbufCursor);
     
-    for (i = 0; i < kNumRxDesc; i++) {
-        if (rxMbufArray[i]) {
-            freePacket(rxMbufArray[i]);
-            rxMbufArray[i] = NULL;
+    if (rxMbufArray) {
+        for (i = 0; i < numRxDesc; i++) {
+            if (rxMbufArray[i]) {
+                freePacket(rxMbufArray[i]);
+                rxMbufArray[i] = NULL;
+            }
         }
     }
     if (rxBufArrayMem) {
-        IOFree(rxBufArrayMem, kRxBufArraySize);
+        IOFree(rxBufArrayMem, numRxDesc * sizeof(mbuf_t));
         rxBufArrayMem = NULL;
         rxMbufArray = NULL;
     }
+    rxFillCount = 0;
+    
     if (sparePktHead) {
         mbuf_freem(sparePktHead);
         sparePktHead = sparePktTail = NULL;
@@ -449,50 +571,271 @@ void AtherosE2200::freeRxResources()
     }
 }
 
-void AtherosE2200::freeTxResources()
+/* AtherosE2200::setupTxBounceBuffers()
+ *
+ * Allocate one bounce buffer per tx descriptor for the copy-break path
+ * and the TSO header pool. Failure isn't fatal, it only disables
+ * copy-break and TSO headers are edited in place again.
+ */
+
+void AtherosE2200::setupTxBounceBuffers()
 {
-    if (txDescDmaCmd) {
-        txDescDmaCmd->complete();
-        txDescDmaCmd->clearMemoryDescriptor();
-        txDescDmaCmd->release();
-        txDescDmaCmd = NULL;
-    }
-    if (txBufDesc) {
-        txBufDesc->complete();
-        txBufDesc->release();
-        txBufDesc = NULL;
-        txPhyAddr = (IOPhysicalAddress64)NULL;
+    IODMACommand::Segment64 seg;
+    UInt64 offset = 0;
+    UInt32 numSegs = 1;
+    
+    txBounceDesc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, (kIODirectionOut | kIOMemoryPhysicallyContiguous | kIOMemoryHostPhysicallyContiguous), (numTxDesc * kTxBounceSize), 0xFFFFFFFFFFFFF000ULL);
+    
+    if (!txBounceDesc) {
+        IOLog("Couldn't alloc txBounceDesc.\n");
+        goto error_buff;
+    }
+    if (txBounceDesc->prepare() != kIOReturnSuccess) {
+        IOLog("txBounceDesc->prepare() failed.\n");
+        goto error_prep;
+    }
+    txBounceArray = (UInt8 *)txBounceDesc->getBytesNoCopy();
+    
+    txBounceDmaCmd = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped, 0, 1, mapper, NULL);
+    
+    if (!txBounceDmaCmd) {
+        IOLog("Couldn't alloc txBounceDmaCmd.\n");
+        goto error_dma;
+    }
+    if (txBounceDmaCmd->setMemoryDescriptor(txBounceDesc) != kIOReturnSuccess) {
+        IOLog("setMemoryDescriptor() failed.\n");
+        goto error_set_desc;
     }
+    if (txBounceDmaCmd->gen64IOVMSegments(&offset, &seg, &numSegs) != kIOReturnSuccess) {
+        IOLog("gen64IOVMSegments() failed.\n");
+        goto error_segm;
+    }
+    txBouncePhyAddr = seg.fIOVMAddr;
+    
+done:
+    return;
+    
+error_segm:
+    txBounceDmaCmd->clearMemoryDescriptor();
+    
+error_set_desc:
+    RELEASE(txBounceDmaCmd);
+    
+error_dma:
+    txBounceDesc->complete();
+    
+error_prep:
+    RELEASE(txBounceDesc);
+    
+error_buff:
+    txBounceArray = NULL;
+    txCopyBreak = 0;
+    IOLog("Tx copy-break disabled.\n");
+    goto done;
+}
+
+void AtherosE2200::freeTxResources()
+{
+    /* The descriptor array is released with the arena. */
+    txDescArray = NULL;
+    txPhyAddr = (IOPhysicalAddress64)NULL;
+
     RELEASE(txMbufCursor);
+    
+    if (txBounceDmaCmd) {
+        txBounceDmaCmd->complete();
+        txBounceDmaCmd->clearMemoryDescriptor();
+        RELEASE(txBounceDmaCmd);
+    }
+    if (txBounceDesc) {
+        txBounceDesc->complete();
+        RELEASE(txBounceDesc);
+        txBounceArray = NULL;
+    }
 
     if (txBufArrayMem) {
-        IOFree(txBufArrayMem, kTxBufArraySize);
+        IOFree(txBufArrayMem, numTxDesc * sizeof(mbuf_t));
         txBufArrayMem = NULL;
         txMbufArray = NULL;
     }
 }
 
+/* AtherosE2200::resizeRxBuffers()
+ *
+ * Replace all rx buffers with buffers of rxBufferSizeNew bytes. Must be
+ * called while the MAC is in reset. The new buffers are allocated up
+ * front so that we keep the old ones in case we run out of memory.
+ */
+
+bool AtherosE2200::resizeRxBuffers()
+{
+    IOPhysicalSegment rxSegment;
+    mbuf_t *newArray;
+    mbuf_t m;
+    UInt32 i;
+    bool result = false;
+    
+    newArray = (mbuf_t *)IOMallocZero(numRxDesc * sizeof(mbuf_t));
+    
+    if (!newArray)
+        goto error_array;
+    
+    for (i = 0; i < numRxDesc; i++) {
+        m = allocatePacket(rxBufferSizeNew);
+        
+        if (!m)
+            goto error_buf;
+        
+        newArray[i] = m;
+        
+        if ((rxMbufCursor->getPhysicalSegments(m, &rxSegment, 1) != 1) || (rxSegment.location & 0x07ff))
+            goto error_buf;
+    }
+    /* Now that we have all buffers, swap them in. */
+    for (i = 0; i < numRxDesc; i++) {
+        if (rxMbufArray[i])
+            freePacket(rxMbufArray[i]);
+
+        rxMbufArray[i] = newArray[i];
+        
+        rxMbufCursor->getPhysicalSegments(rxMbufArray[i], &rxSegment, 1);
+        rxFreeDescArray[i].addr = OSSwapHostToLittleInt64(rxSegment.location);
+    }
+    IOFree(newArray, numRxDesc * sizeof(mbuf_t));
+    rxBufferSize = rxBufferSizeNew;
+
+    /* The ring is fully populated now. */
+    if (rxFillCount < numRxDesc) {
+        rxFillCount = numRxDesc;
+        reportRxRingFull();
+    }
+
+    /* The spare buffers must match the new size too. */
+    while (sparePktHead) {
+        m = sparePktHead;
+        sparePktHead = mbuf_next(m);
+        mbuf_setnext(m, NULL);
+        freePacket(m);
+    }
+    spareNum = 0;
+    sparePktHead = sparePktTail = allocatePacket(rxBufferSize);
+    
+    if (sparePktHead) {
+        spareNum = 1;
+        refillSpareBuffers();
+    }
+    DebugLog("Using %u bytes rx buffers.\n", rxBufferSize);
+    result = true;
+    
+done:
+    return result;
+    
+error_buf:
+    for (i = 0; i < numRxDesc; i++) {
+        if (newArray[i])
+            freePacket(newArray[i]);
+    }
+    IOFree(newArray, numRxDesc * sizeof(mbuf_t));
+    
+error_array:
+    IOLog("Failed to allocate %u bytes rx buffers.\n", rxBufferSizeNew);
+    rxBufferSizeNew = rxBufferSize;
+    goto done;
+}
+
 void AtherosE2200::refillSpareBuffers()
 {
     mbuf_t m;
 
     while (spareNum < kRxNumSpareMbufs) {
-        m = allocatePacket(kRxBufferPktSize);
+        m = allocatePacket(rxBufferSize);
 
         if (!m)
             break;
         
-        mbuf_setnext(sparePktTail, m);
-        sparePktTail = m;
+        if (sparePktHead) {
+            mbuf_setnext(sparePktTail, m);
+            sparePktTail = m;
+        } else {
+            sparePktHead = sparePktTail = m;
+        }
         OSIncrementAtomic(&spareNum);
     }
 }
 
+/* AtherosE2200::growRxRing()
+ *
+ * Populate up to count more free descriptors behind the part of the
+ * ring which is already in use and hand them to the NIC. As long as the
+ * ring isn't full, the producer index is owned by this method and
+ * rxInterrupt() leaves it alone. Therefore the producer index must be
+ * advanced before rxFillCount is updated, which rxInterrupt() reads
+ * through a volatile access.
+ */
+
+void AtherosE2200::growRxRing(UInt32 count)
+{
+    IOPhysicalSegment rxSegment;
+    UInt32 fill = rxFillCount;
+    UInt32 last = fill + count;
+    mbuf_t m;
+    
+    if (last > numRxDesc)
+        last = numRxDesc;
+    
+    while (fill < last) {
+        m = allocatePacket(rxBufferSize);
+        
+        if (!m)
+            break;
+        
+        if ((rxMbufCursor->getPhysicalSegments(m, &rxSegment, 1) != 1) || (rxSegment.location & 0x07ff)) {
+            freePacket(m);
+            break;
+        }
+        rxMbufArray[fill] = m;
+        rxFreeDescArray[fill].addr = OSSwapHostToLittleInt64(rxSegment.location);
+        fill++;
+    }
+    if (fill == rxFillCount)
+        goto done;
+    
+    /* Make the new free descriptors visible before handing them to the NIC. */
+    alxDescBarrier();
+    alxWriteMem16(ALX_RFD_PIDX, fill - 1);
+    
+    /* rxInterrupt() must not see the new count before the doorbell. */
+    OSMemoryBarrier();
+    rxFillCount = fill;
+    
+    if (fill == numRxDesc)
+        reportRxRingFull();
+    
+done:
+    return;
+}
+
+void AtherosE2200::reportRxRingFull()
+{
+    UInt64 now, delta;
+    UInt32 ms;
+    
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - rxFillStamp, &delta);
+    ms = (UInt32)(delta / 1000000);
+    
+    setProperty(kRxRingFullName, ms, 32);
+    IOLog("All %u rx buffers posted %u ms after start.\n", numRxDesc, ms);
+}
+
 IOReturn AtherosE2200::refillAction(OSObject *owner, void *arg1, void *arg2, void *arg3, void *arg4)
 {
     AtherosE2200 *ethCtlr = OSDynamicCast(AtherosE2200, owner);
     
     if (ethCtlr) {
+        if (ethCtlr->rxFillCount < ethCtlr->numRxDesc)
+            ethCtlr->growRxRing(kRxFillStep);
+        
         ethCtlr->refillSpareBuffers();
     }
     return kIOReturnSuccess;
@@ -506,7 +849,7 @@ void AtherosE2200::clearDescriptors()
     DebugLog("clearDescriptors() ===>\n");
     
     /* Cleanup txMbufArray. */
-    for (i = 0; i < kNumTxDesc; i++) {
+    for (i = 0; i < numTxDesc; i++) {
         m = txMbufArray[i];
         
         if (m) {
@@ -514,11 +857,14 @@ void AtherosE2200::clearDescriptors()
             txMbufArray[i] = NULL;
         }
     }
-    txDirtyDescIndex = txNextDescIndex = 0;
-    txNumFreeDesc = kNumTxDesc;
+    txConsumer.dirtyDescIndex = txProducer.nextDescIndex = 0;
+    txShared.numFreeDesc = numTxDesc;
+    txShared.bytesInFlight = 0;
+    txShared.queueLimited = 0;
+    txShared.probeStamp = 0;
     
     /* Cleanup rxRetDescArray. */
-    bzero(rxRetDescArray, kRxRetDescArraySize);
+    bzero(rxRetDescArray, numRxDesc * sizeof(QCARxRetDesc));
     rxNextDescIndex = 0;
 
     DebugLog("clearDescriptors() <===\n");
@@ -527,15 +873,54 @@ void AtherosE2200::clearDescriptors()
 void AtherosE2200::getParams(UInt32 *intrLimit)
 {
     OSNumber *intrRate;
+    OSNumber *txRate;
+    OSBoolean *msix;
+    OSNumber *budget;
     OSBoolean *tso4;
     OSBoolean *tso6;
     OSBoolean *csoV6;
+    OSBoolean *proxy;
+    OSArray *wakeList;
+    OSNumber *wakePort;
     OSBoolean *poll;
+    OSBoolean *resume;
+    OSNumber *paceRate;
+    OSNumber *copyBreak;
+    UInt32 i;
 
     poll = OSDynamicCast(OSBoolean, getProperty(kEnableRxPollName));
     rxPoll = (poll) ? poll->getValue() : false;
     
     IOLog("RxPoll support %s.\n", rxPoll ? onName : offName);
+    
+    poll = OSDynamicCast(OSBoolean, getProperty(kAdaptivePollName));
+    adaptivePoll = (poll) ? poll->getValue() : false;
+    
+    IOLog("Adaptive polling %s.\n", adaptivePoll ? onName : offName);
+
+    poll = OSDynamicCast(OSBoolean, getProperty(kAdaptiveLpiName));
+    adaptiveLpi = (poll) ? poll->getValue() : false;
+    
+    IOLog("Adaptive LPI %s.\n", adaptiveLpi ? onName : offName);
+    
+    budget = OSDynamicCast(OSNumber, getProperty(kAspmIdleTimeName));
+    aspmIdleTime = (budget) ? budget->unsigned32BitValue() : kAspmIdleTimeDef;
+    
+    if (aspmIdleTime > kAspmIdleTimeMax)
+        aspmIdleTime = kAspmIdleTimeMax;
+    
+    poll = OSDynamicCast(OSBoolean, getProperty(kAspmL0sName));
+    aspmL0s = (poll) ? poll->getValue() : false;
+    
+    if (aspmIdleTime)
+        IOLog("ASPM L1%s after %us idle.\n", aspmL0s ? "/L0s" : "", aspmIdleTime);
+    else
+        IOLog("ASPM while link up %s.\n", offName);
+
+    resume = OSDynamicCast(OSBoolean, getProperty(kEnableFastResumeName));
+    fastResume = (resume) ? resume->getValue() : false;
+    
+    IOLog("Fast resume %s.\n", fastResume ? onName : offName);
 
     tso4 = OSDynamicCast(OSBoolean, getProperty(kEnableTSO4Name));
     enableTSO4 = (tso4) ? tso4->getValue() : false;
@@ -552,9 +937,141 @@ void AtherosE2200::getParams(UInt32 *intrLimit)
     
     IOLog("TCP/IPv6 checksum offload %s.\n", enableCSO6 ? onName : offName);
     
+    proxy = OSDynamicCast(OSBoolean, getProperty(kEnableSleepProxyName));
+    sleepProxy = (proxy) ? proxy->getValue() : false;
+    
+    IOLog("ARP/NS offload while asleep %s.\n", sleepProxy ? onName : offName);
+    
+    /*
+     * The chip matches SYNs to one port per address family, so that
+     * only the first valid port of the list is used.
+     */
+    wakeList = OSDynamicCast(OSArray, getProperty(kSynWakePortsName));
+    synWakePort = 0;
+    
+    for (i = 0; wakeList && (i < wakeList->getCount()); i++) {
+        wakePort = OSDynamicCast(OSNumber, wakeList->getObject(i));
+        
+        if (!wakePort || !wakePort->unsigned16BitValue())
+            continue;
+        
+        if (!synWakePort) {
+            synWakePort = wakePort->unsigned16BitValue();
+        } else {
+            IOLog("Only one SYN wake port is supported, ignoring port %u.\n", wakePort->unsigned16BitValue());
+        }
+    }
+    if (synWakePort)
+        IOLog("Wake on TCP SYN to port %u.\n", synWakePort);
+    
     intrRate = OSDynamicCast(OSNumber, getProperty(kIntrRateName));
     *intrLimit = 5000;
     
     if (intrRate)
         *intrLimit = intrRate->unsigned32BitValue();
+    
+    msix = OSDynamicCast(OSBoolean, getProperty(kEnableMSIXName));
+    useMSIX = (msix) ? msix->getValue() : false;
+    
+    IOLog("MSI-X support %s.\n", useMSIX ? onName : offName);
+
+    /* The tx completion rate defaults to the rx rate. */
+    txRate = OSDynamicCast(OSNumber, getProperty(kTxIntrRateName));
+    txIntrRate = (txRate) ? txRate->unsigned32BitValue() : *intrLimit;
+    
+    if (txIntrRate < 2500)
+        txIntrRate = 2500;
+    else if (txIntrRate > 10000)
+        txIntrRate = 10000;
+    
+    budget = OSDynamicCast(OSNumber, getProperty(kRxBudgetName));
+    rxBudget = (budget) ? budget->unsigned32BitValue() : kRxBudgetDef;
+    
+    if (rxBudget < kBudgetMin)
+        rxBudget = kBudgetMin;
+    
+    budget = OSDynamicCast(OSNumber, getProperty(kBusyPollName));
+    busyPollTime = (budget) ? budget->unsigned32BitValue() : 0;
+    
+    if (busyPollTime > kBusyPollMaxUS)
+        busyPollTime = kBusyPollMaxUS;
+    
+    busyPollCur = busyPollTime;
+    
+    if (busyPollTime)
+        IOLog("Busy polling for up to %uµs.\n", busyPollTime);
+    
+    budget = OSDynamicCast(OSNumber, getProperty(kTxBudgetName));
+    txBudget = (budget) ? budget->unsigned32BitValue() : kTxBudgetDef;
+    
+    if (txBudget < kBudgetMin)
+        txBudget = kBudgetMin;
+    
+    numTxDesc = getRingSizeParam(kTxRingSizeName, kNumTxDescDef, kNumTxDescMin);
+    txDescMask = numTxDesc - 1;
+    txWakeThreshold = numTxDesc >> kTxQueueWakeShift;
+
+    numRxDesc = getRingSizeParam(kRxRingSizeName, kNumRxDescDef, kNumRxDescMin);
+    rxDescMask = numRxDesc - 1;
+
+    IOLog("Using %u tx and %u rx descriptors.\n", numTxDesc, numRxDesc);
+    
+    copyBreak = OSDynamicCast(OSNumber, getProperty(kTxCopyBreakName));
+    txCopyBreak = (copyBreak) ? copyBreak->unsigned32BitValue() : kTxCopyBreakDef;
+    
+    if (txCopyBreak > kTxBounceSize)
+        txCopyBreak = kTxBounceSize;
+    
+    IOLog("Tx copy-break %u bytes.\n", txCopyBreak);
+
+    paceRate = OSDynamicCast(OSNumber, getProperty(kTxPaceRateName));
+    txPaceRate = (paceRate) ? paceRate->unsigned32BitValue() : 0;
+    
+    if (txPaceRate)
+        IOLog("Tx pacing at %u Mbit/s.\n", txPaceRate);
+    else
+        IOLog("Tx pacing %s.\n", offName);
+    
+    /* DMA tuning, the defaults are those of the Linux driver. */
+    dmaParams.tpdBurst = getDmaParam(kTpdBurstName, ALX_TXQ_TPD_BURSTPREF_DEF, 1, ALX_TXQ0_TPD_BURSTPREF_MASK);
+    dmaParams.txfBurst = getDmaParam(kTxfBurstName, ALX_TXQ_TXF_BURST_PREF_DEF, 1, ALX_TXQ0_TXF_BURST_PREF_MASK);
+    dmaParams.rfdPrefetch = getDmaParam(kRfdPrefetchName, ALX_RXQ0_NUM_RFD_PREF_DEF, 1, ALX_RXQ0_NUM_RFD_PREF_MASK);
+    dmaParams.readDelay = getDmaParam(kDmaReadDelayName, ALX_DMA_RDLY_CNT_DEF, 0, ALX_DMA_RDLY_CNT_MASK);
+    dmaParams.writeDelay = getDmaParam(kDmaWriteDelayName, ALX_DMA_WDLY_CNT_DEF, 0, ALX_DMA_WDLY_CNT_MASK);
+    dmaParams.readChannels = getDmaParam(kDmaReadChannelsName, 0, 0, ALX_DMA_RCHNL_SEL_MASK + 1);
+    
+    IOLog("DMA: tpd burst %u, txf burst %u, rfd prefetch %u, delays %u/%u.\n", dmaParams.tpdBurst, dmaParams.txfBurst, dmaParams.rfdPrefetch, dmaParams.readDelay, dmaParams.writeDelay);
+}
+
+UInt32 AtherosE2200::getRingSizeParam(const char *name, UInt32 defSize, UInt32 minSize)
+{
+    OSNumber *num = OSDynamicCast(OSNumber, getProperty(name));
+    UInt32 size = defSize;
+    
+    if (num) {
+        size = num->unsigned32BitValue();
+        
+        /* Ring sizes must be a power of 2. */
+        if ((size < minSize) || (size > kNumDescMax) || (size & (size - 1))) {
+            IOLog("Invalid %s %u. Using default value %u.\n", name, size, defSize);
+            size = defSize;
+        }
+    }
+    return size;
+}
+
+UInt32 AtherosE2200::getDmaParam(const char *name, UInt32 defValue, UInt32 minValue, UInt32 maxValue)
+{
+    OSNumber *num = OSDynamicCast(OSNumber, getProperty(name));
+    UInt32 value = defValue;
+    
+    if (num) {
+        value = num->unsigned32BitValue();
+        
+        if ((value < minValue) || (value > maxValue)) {
+            IOLog("Invalid %s %u. Using default value %u.\n", name, value, defValue);
+            value = defValue;
+        }
+    }
+    return value;
 }
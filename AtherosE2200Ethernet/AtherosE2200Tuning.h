@@ -0,0 +1,283 @@
+/* AtherosE2200Tuning.h -- Self-contained tuning helpers.
+ *
+ * Copyright (c) 2014 Laura Müller <laura-mueller@uni-duesseldorf.de>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * Driver for Atheros Killer E2200 PCIe ethernet controllers.
+ *
+ * The functions in this file depend on nothing but their arguments and
+ * the basic integer types, so that they can be built and tested on the
+ * host with the programs in the Tests directory.
+ */
+
+#ifndef ATHEROSE2200_TUNING_H_
+#define ATHEROSE2200_TUNING_H_
+
+/* Limits of the adaptive poll controller. */
+#define kPollIntervalMin    50000       /* 50µs */
+#define kPollIntervalMax    1000000     /* 1ms */
+#define kPollThresholdMin   2
+#define kPollThresholdMax   64
+
+/*
+ * Ratio of the high to the low thresholds. The packet thresholds use 4
+ * and the byte thresholds 16, like the static per-speed values did.
+ */
+#define kPollPacketRatio    4
+#define kPollByteRatio      16
+
+/* Rx activity observed during one timer period, input of the poll tuner. */
+typedef struct QCAPollStats {
+    UInt32 polls;
+    UInt32 emptyPolls;
+    UInt32 fullPolls;
+} QCAPollStats;
+
+/*
+ * The poll controller. Mostly empty polls mean that we are polling while
+ * traffic is light, so that the interval is stretched and the thresholds
+ * are raised. Mostly full batches mean that packets wait in the ring for
+ * too long, so that the interval is shortened. Otherwise the thresholds
+ * drift back down. The byte thresholds follow the packet thresholds
+ * scaled by avgSize, the average frame size, unless it is 0. Returns
+ * true in case any parameter changed.
+ *
+ * T is IONetworkPacketPollingParameters in the driver.
+ */
+template <class T>
+static bool tunePollParams(T *params, const QCAPollStats *stats, UInt32 avgSize)
+{
+    UInt64 interval = params->pollIntervalTime;
+    UInt32 low = params->lowThresholdPackets;
+    UInt32 lowBytes = params->lowThresholdBytes;
+    UInt32 highBytes = params->highThresholdBytes;
+    bool changed;
+
+    if (stats->polls) {
+        if ((stats->emptyPolls * 2) > stats->polls) {
+            interval <<= 1;
+            low += (low >> 1);
+        } else if ((stats->fullPolls * 10) > stats->polls) {
+            interval >>= 1;
+        } else if ((stats->emptyPolls * 10) < stats->polls) {
+            /* Make sure that small thresholds can reach the minimum too. */
+            low -= (low >= 8) ? (low >> 2) : 1;
+        }
+    }
+    if (interval < kPollIntervalMin)
+        interval = kPollIntervalMin;
+    else if (interval > kPollIntervalMax)
+        interval = kPollIntervalMax;
+
+    if (low < kPollThresholdMin)
+        low = kPollThresholdMin;
+    else if (low > kPollThresholdMax)
+        low = kPollThresholdMax;
+
+    if (avgSize) {
+        lowBytes = low * avgSize;
+        highBytes = lowBytes * kPollByteRatio;
+    }
+    changed = ((params->pollIntervalTime != interval) || (params->lowThresholdPackets != low) ||
+               (params->highThresholdPackets != low * kPollPacketRatio) ||
+               (params->lowThresholdBytes != lowBytes) || (params->highThresholdBytes != highBytes));
+
+    params->pollIntervalTime = interval;
+    params->lowThresholdPackets = low;
+    params->highThresholdPackets = low * kPollPacketRatio;
+    params->lowThresholdBytes = lowBytes;
+    params->highThresholdBytes = highBytes;
+
+    return changed;
+}
+
+/* This is the receive buffer size (must be exactly 2048 bytes to match a cluster). */
+#define kRxBufferPktSize 2048
+#define kRxJumboBufSize 4096
+
+/*
+ * The rx buffer size for frames of up to maxSize bytes plus a vlan tag.
+ * Jumbo frames get page sized buffers, the largest ones which are still
+ * physically contiguous.
+ */
+static inline UInt32 rxBufferSizeFor(UInt32 maxSize)
+{
+    return ((maxSize + 4) > kRxBufferPktSize) ? kRxJumboBufSize : kRxBufferPktSize;
+}
+
+/* Maximum burst in bytes the tx pacer releases at once. */
+#define kTxPaceBurst        (2 * 65536)
+
+/*
+ * Credit the tx pacer's token bucket for ns nanoseconds at rate Mbit/s,
+ * i.e. bits per microsecond, limited to one burst. Returns true in case
+ * there is credit left to send.
+ */
+static inline bool txPaceCredit(SInt64 *tokens, UInt64 ns, UInt32 rate)
+{
+    *tokens += (SInt64)((ns * rate) / 8000);
+    
+    if (*tokens > kTxPaceBurst)
+        *tokens = kTxPaceBurst;
+    
+    return (*tokens > 0);
+}
+
+/*
+ * Take a frame's credit. TSO frames must be charged with their full length
+ * including the headers, as all of it goes out on the wire.
+ */
+static inline void txPaceDebit(SInt64 *tokens, UInt32 frameLen)
+{
+    *tokens -= frameLen;
+}
+
+/* Microseconds it takes at rate Mbit/s until a debt is paid back. */
+static inline UInt32 txPaceDelay(SInt64 tokens, UInt32 rate)
+{
+    return (UInt32)(((-tokens) * 8) / rate) + 1;
+}
+
+/* A descriptor ring in the descriptor arena, align is a power of 2. */
+typedef struct QCADescRange {
+    UInt64 size;
+    UInt64 align;
+} QCADescRange;
+
+static inline UInt64 descAlign(UInt64 offset, UInt64 align)
+{
+    return (offset + align - 1) & ~(align - 1);
+}
+
+/*
+ * Size of an arena holding the ranges, laid out in the order given. The
+ * arena itself must be aligned to the largest alignment.
+ */
+static inline UInt64 descArenaLayoutSize(const QCADescRange *ranges, UInt32 num)
+{
+    UInt64 end = 0;
+    UInt32 i;
+
+    for (i = 0; i < num; i++)
+        end = descAlign(end, ranges[i].align) + ranges[i].size;
+
+    return end;
+}
+
+/*
+ * Place a range of size bytes aligned to align behind the first used
+ * bytes of an arena of arenaSize bytes. Returns false in case it doesn't
+ * fit, otherwise its offset in start.
+ */
+static inline bool descRangeFit(UInt64 used, UInt64 size, UInt64 align, UInt64 arenaSize, UInt64 *start)
+{
+    UInt64 offset = descAlign(used, align);
+
+    if ((offset > arenaSize) || (size > (arenaSize - offset)))
+        return false;
+
+    *start = offset;
+
+    return true;
+}
+
+/* The NIC takes a single upper 32 bit address for all rings. */
+static inline bool descArenaCrosses4GB(UInt64 phyAddr, UInt64 size)
+{
+    return (size && ((phyAddr >> 32) != ((phyAddr + size - 1) >> 32)));
+}
+
+/*
+ * Descriptors are accessed as two quadwords assembled in registers so that
+ * each half takes a single memory transaction. The vlan tag is kept in
+ * network byte order by the hardware. B converts between the host's byte
+ * order and the little endian one of the NIC with toLE64() and fromLE64().
+ */
+template <class B>
+static inline void txDescStore(volatile UInt64 *q, UInt16 length, UInt16 vlanTag, UInt32 word1, UInt64 addr)
+{
+    UInt16 tag = (UInt16)((vlanTag << 8) | (vlanTag >> 8));
+
+    q[0] = B::toLE64(((UInt64)word1 << 32) | ((UInt64)tag << 16) | length);
+    q[1] = B::toLE64(addr);
+}
+
+/* Quadword i of an RRD: 0 is word0 and rssHash, 1 is word2 and word3. */
+template <class B>
+static inline UInt64 rxDescLoad(volatile const UInt64 *q, UInt32 i)
+{
+    return B::fromLE64(q[i]);
+}
+
+/* The per packet part of a TPD stream. */
+typedef struct QCATxPacket {
+    UInt64 hdrAddr;     /* address of the copied headers */
+    UInt32 hdrLen;      /* 0 in case the headers weren't copied */
+    UInt32 ctxLen;      /* total length for the TSO over IPv6 context, 0 for none */
+    UInt32 cmd;
+    UInt16 vlanTag;
+} QCATxPacket;
+
+/*
+ * Emit the TPDs of one packet into ring, which has mask + 1 descriptors,
+ * starting at index: the context descriptor of TSO over IPv6, the header
+ * TPD and the payload segments, the last of them with eop set and owning
+ * m in mbufs. Zero length segments, like a first mbuf which held nothing
+ * but the stripped headers, are skipped. Returns the number of TPDs used
+ * and the index of the last one in lastIndex, or 0 without touching the
+ * ring in case there is no payload.
+ *
+ * B converts to little endian as for txDescStore(), S is a physical
+ * segment with location and length and M the mbuf type.
+ */
+template <class B, class S, class M>
+static UInt32 txEmitPacket(volatile UInt64 *ring, M *mbufs, UInt32 mask, UInt32 index, const QCATxPacket *pkt,
+                           const S *segs, UInt32 numSegs, M m, UInt32 eop, UInt32 *lastIndex)
+{
+    UInt32 num = 0;
+    UInt32 last = numSegs;
+    UInt32 i;
+
+    for (i = 0; i < numSegs; i++) {
+        if (segs[i].length)
+            last = i;
+    }
+    if (last == numSegs)
+        return 0;
+
+    if (pkt->ctxLen) {
+        txDescStore<B>(&ring[2 * index], 0, pkt->vlanTag, pkt->cmd, pkt->ctxLen);
+        mbufs[index] = 0;
+        index = (index + 1) & mask;
+        num++;
+    }
+    if (pkt->hdrLen) {
+        txDescStore<B>(&ring[2 * index], (UInt16)pkt->hdrLen, pkt->vlanTag, pkt->cmd, pkt->hdrAddr);
+        mbufs[index] = 0;
+        index = (index + 1) & mask;
+        num++;
+    }
+    for (i = 0; i <= last; i++) {
+        if (!segs[i].length)
+            continue;
+
+        txDescStore<B>(&ring[2 * index], (UInt16)segs[i].length, pkt->vlanTag, (i == last) ? (pkt->cmd | eop) : pkt->cmd, segs[i].location);
+        mbufs[index] = (i == last) ? m : 0;
+        *lastIndex = index;
+        index = (index + 1) & mask;
+        num++;
+    }
+    return num;
+}
+
+#endif /* ATHEROSE2200_TUNING_H_ */
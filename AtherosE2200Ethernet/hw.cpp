@@ -1160,6 +1160,168 @@ int alx_config_wol(struct alx_hw *hw)
     return err;
 }
 
+static inline u32 alx_get_be32(const u8 *p)
+{
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+/* same layout as STAD0/STAD1 */
+static void alx_write_pmofld_mac(struct alx_hw *hw, u32 reg, const u8 *mac)
+{
+    alx_write_mem32(hw, reg, alx_get_be32(mac + 2));
+    alx_write_mem32(hw, reg + 4, ((u32)mac[0] << 8) | mac[1]);
+}
+
+/* word i of an IPv6 address, 0 is the least significant one */
+static inline u32 alx_get_ipv6_word(const u8 *addr, int i)
+{
+    return alx_get_be32(addr + 12 - (i << 2));
+}
+
+/* the lowest register holds the least significant word */
+static void alx_write_pmofld_ipv6(struct alx_hw *hw, u32 reg, const u8 *addr)
+{
+    int i;
+
+    for (i = 0; i < 4; i++)
+        alx_write_mem32(hw, reg + (i << 2), alx_get_ipv6_word(addr, i));
+}
+
+/*
+ * Add one of the interface's IPv6 addresses to the offload parameters.
+ * KAME style scoped link-local addresses carry the scope id in their
+ * second word, which is cleared. Targets sharing a solicited-node address
+ * go into the same NS engine, addresses beyond the engines' capacity are
+ * dropped. With syn set the first global address becomes the SYN target.
+ */
+void alx_pmofld_add_ipv6(struct alx_pmofld *ofld, const u8 *addr, bool ns, bool syn)
+{
+    u8 a6[16];
+    int j;
+
+    memcpy(a6, addr, 16);
+
+    if ((a6[0] == 0xFE) && ((a6[1] & 0xC0) == 0x80)) {
+        a6[2] = a6[3] = 0;
+    } else if (syn && !ofld->syn_v6) {
+        memcpy(ofld->syn_ipv6, a6, 16);
+        ofld->syn_v6 = true;
+    }
+    if (!ns)
+        return;
+
+    for (j = 0; j < ofld->num_ns; j++) {
+        if (!memcmp(&ofld->ns[j].tar[0][13], &a6[13], 3))
+            break;
+    }
+    if (j == ofld->num_ns) {
+        if (ofld->num_ns == ALX_PMOFLD_MAX_NS)
+            return;
+
+        ofld->num_ns++;
+    }
+    if (ofld->ns[j].num_tar < ALX_PMOFLD_MAX_TAR)
+        memcpy(ofld->ns[j].tar[ofld->ns[j].num_tar++], a6, 16);
+}
+
+/*
+ * Compute the SYN filter registers for a connection request to syn_port
+ * on our addresses. SYNs from any remote host and port are accepted, a
+ * source address and port of 0 act as wildcards. The SYNCV4_ANY and
+ * SYNCV6_ANY bits are left alone as their meaning is undocumented.
+ * Returns the PMOFLD bits which enable the filters set up in syn.
+ */
+u32 alx_pmofld_syn_regs(const struct alx_pmofld *ofld, struct alx_pmofld_syn *syn)
+{
+    u32 en = 0;
+    int i;
+
+    memset(syn, 0, sizeof(*syn));
+
+    if (ofld->syn_v4) {
+        syn->ipv4_da = alx_get_be32(ofld->ipv4);
+        syn->v4port = (u32)ofld->syn_port << ALX_SYNC_V4PORT_DST_SHIFT;
+        en |= ALX_PMOFLD_SYNCV4_EN;
+    }
+    if (ofld->syn_v6) {
+        for (i = 0; i < 4; i++)
+            syn->ipv6_da[i] = alx_get_ipv6_word(ofld->syn_ipv6, i);
+
+        syn->v6port = (u32)ofld->syn_port << ALX_SYNC_V6PORT_DST_SHIFT;
+        en |= ALX_PMOFLD_SYNCV6_EN;
+    }
+    return en;
+}
+
+void alx_config_pmofld(struct alx_hw *hw, const struct alx_pmofld *ofld)
+{
+    static const u32 rmt_reg[ALX_PMOFLD_MAX_NS] = {
+        ALX_1ST_REMOTE_IPV6_0, ALX_2ND_REMOTE_IPV6_0
+    };
+    static const u32 sn_reg[ALX_PMOFLD_MAX_NS] = {
+        ALX_1ST_SN_IPV6_0, ALX_2ND_SN_IPV6_0
+    };
+    static const u32 tar_reg[ALX_PMOFLD_MAX_NS][ALX_PMOFLD_MAX_TAR] = {
+        { ALX_1ST_TAR_IPV6_1_0, ALX_1ST_TAR_IPV6_2_0 },
+        { ALX_2ND_TAR_IPV6_1_0, ALX_2ND_TAR_IPV6_2_0 }
+    };
+    static const u32 mac_reg[ALX_PMOFLD_MAX_NS] = {
+        ALX_1ST_NS_MAC0, ALX_2ND_NS_MAC0
+    };
+    static const u8 any[16] = { 0 };
+    u8 sn[16] = { 0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0xFF };
+    struct alx_pmofld_syn syn;
+    u32 pmofld = 0;
+    u32 syn_en;
+    int i, j;
+
+    if (ofld && ofld->arp) {
+        /* reply to requests from any host */
+        alx_write_mem32(hw, ALX_ARP_REMOTE_IPV4, 0);
+        alx_write_mem32(hw, ALX_ARP_HOST_IPV4, alx_get_be32(ofld->ipv4));
+        alx_write_pmofld_mac(hw, ALX_ARP_MAC0, ofld->mac);
+        pmofld |= ALX_PMOFLD_ARP_EN;
+    }
+    for (i = 0; ofld && (i < ofld->num_ns); i++) {
+        const struct alx_pmofld_ns *ns = &ofld->ns[i];
+
+        /* ff02::1:ffXX:XXXX of the targets */
+        memcpy(&sn[13], &ns->tar[0][13], 3);
+
+        alx_write_pmofld_ipv6(hw, rmt_reg[i], any);
+        alx_write_pmofld_ipv6(hw, sn_reg[i], sn);
+
+        for (j = 0; j < ALX_PMOFLD_MAX_TAR; j++)
+            alx_write_pmofld_ipv6(hw, tar_reg[i][j],
+                                  (j < ns->num_tar) ? ns->tar[j] : any);
+
+        alx_write_pmofld_mac(hw, mac_reg[i], ofld->mac);
+        pmofld |= ALX_PMOFLD_NS_EN;
+    }
+    syn_en = ofld ? alx_pmofld_syn_regs(ofld, &syn) : 0;
+
+    if (syn_en & ALX_PMOFLD_SYNCV4_EN) {
+        alx_write_mem32(hw, ALX_SYNC_IPV4_SA, syn.ipv4_sa);
+        alx_write_mem32(hw, ALX_SYNC_IPV4_DA, syn.ipv4_da);
+        alx_write_mem32(hw, ALX_SYNC_V4PORT, syn.v4port);
+    }
+    if (syn_en & ALX_PMOFLD_SYNCV6_EN) {
+        for (i = 0; i < 4; i++)
+            alx_write_mem32(hw, ALX_SYNC_IPV6_SA0 + (i << 2), syn.ipv6_sa[i]);
+
+        for (i = 0; i < 4; i++)
+            alx_write_mem32(hw, ALX_SYNC_IPV6_DA0 + (i << 2), syn.ipv6_da[i]);
+
+        alx_write_mem32(hw, ALX_SYNC_V6PORT, syn.v6port);
+    }
+    pmofld |= syn_en;
+
+    if (pmofld)
+        pmofld |= ALX_PMOFLD_BY_HW;
+
+    alx_write_mem32(hw, ALX_PMOFLD, pmofld);
+}
+
 #if DISABLED_CODE
 
 int alx_select_powersaving_speed(struct alx_hw *hw, int *speed, u8 *duplex)
@@ -354,6 +354,39 @@ struct alx_rrd {
 				 ALX_SLEEP_WOL_MAGIC | \
 				 ALX_SLEEP_CIFS)
 
+/* for ARP/NS offload while asleep */
+#define ALX_PMOFLD_MAX_NS	2
+#define ALX_PMOFLD_MAX_TAR	2
+
+struct alx_pmofld_ns {
+	/* target addresses sharing one solicited-node address */
+	u8 tar[ALX_PMOFLD_MAX_TAR][16];
+	int num_tar;
+};
+
+struct alx_pmofld {
+	u8 mac[ETH_ALEN];
+	u8 ipv4[4];
+	bool arp;
+	struct alx_pmofld_ns ns[ALX_PMOFLD_MAX_NS];
+	int num_ns;
+	/* wake on a TCP SYN to syn_port */
+	u16 syn_port;
+	bool syn_v4;
+	bool syn_v6;
+	u8 syn_ipv6[16];
+};
+
+/* register values of the SYN filters, ipv6 words are LSW first */
+struct alx_pmofld_syn {
+	u32 ipv4_sa;
+	u32 ipv4_da;
+	u32 v4port;
+	u32 ipv6_sa[4];
+	u32 ipv6_da[4];
+	u32 v6port;
+};
+
 /* for RSS hash type */
 #define ALX_RSS_HASH_TYPE_IPV4		0x1
 #define ALX_RSS_HASH_TYPE_IPV4_TCP	0x2
@@ -603,6 +636,9 @@ void alx_update_hw_stats(struct alx_hw *hw);
 bool alx_wait_reg(struct alx_hw *hw, u32 reg, u32 wait, u32 *val);
 int alx_pre_suspend(struct alx_hw *hw, int speed, u8 duplex);
 int alx_config_wol(struct alx_hw *hw);
+void alx_pmofld_add_ipv6(struct alx_pmofld *ofld, const u8 *addr, bool ns, bool syn);
+u32 alx_pmofld_syn_regs(const struct alx_pmofld *ofld, struct alx_pmofld_syn *syn);
+void alx_config_pmofld(struct alx_hw *hw, const struct alx_pmofld *ofld);
 
 int alx_write_phy_dbg(struct alx_hw *hw, u16 reg, u16 data);
 int alx_read_phy_dbg(struct alx_hw *hw, u16 reg, u16 *pdata);
@@ -209,6 +209,8 @@ _OSReadInt8((base), (byteOffset))
 
 #define wmb() OSSynchronizeIO()
 
+#define L1_CACHE_BYTES 64
+
 /******************************************************************************/
 #pragma mark -
 #pragma mark Locks
@@ -139,6 +139,8 @@
 #define ALX_IRQ_MODU_TIMER				0x1408
 #define ALX_IRQ_MODU_TIMER1_MASK			0xFFFF
 #define ALX_IRQ_MODU_TIMER1_SHIFT			0
+#define ALX_IRQ_MODU_TIMER2_MASK			0xFFFF
+#define ALX_IRQ_MODU_TIMER2_SHIFT			16
 
 #define ALX_PHY_CTRL					0x140C
 #define ALX_PHY_CTRL_100AB_EN				BIT(17)
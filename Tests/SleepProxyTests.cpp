@@ -0,0 +1,533 @@
+/* SleepProxyTests.cpp -- Host tests of the sleep proxy's register setup.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Build and run on the host, e.g. on Linux:
+ *
+ *   c++ -std=c++98 -Wall -I../AtherosE2200Ethernet -o SleepProxyTests SleepProxyTests.cpp
+ *   ./SleepProxyTests
+ *
+ * hw.cpp is built against a fake MMIO window which records every register
+ * write, so that the values alx_config_pmofld() programs can be checked.
+ * Frames are matched against the programmed SYN filter registers the way
+ * the chip is expected to, a register value of 0 being a wildcard.
+ * The program returns 0 in case all checks passed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint16_t UInt16;
+typedef int16_t SInt16;
+typedef uint8_t UInt8;
+typedef int8_t SInt8;
+
+/* The part of linux.h hw.cpp needs. */
+#define u8      UInt8
+#define u16     UInt16
+#define u32     UInt32
+#define u64     UInt64
+#define s32     SInt32
+#define __be16  SInt16
+#define __be32  SInt32
+#define __le16  SInt16
+#define __le32  SInt32
+#define __s8    SInt8
+#define __s16   SInt16
+#define __s32   SInt32
+#define __s64   SInt64
+#define __u8    UInt8
+#define __u16   UInt16
+#define __u32   UInt32
+#define __u64   UInt64
+#define __sum16 UInt16
+
+#define BIT(nr)         (1UL << (nr))
+#define ARRAY_SIZE(x)   (sizeof(x) / sizeof((x)[0]))
+#define __iomem         volatile
+#define DISABLED_CODE   0
+
+#define spinlock_t          int
+#define spin_lock(lock)
+#define spin_unlock(lock)
+#define dev_err(x, y, z)
+#define udelay(x)
+#define mdelay(x)
+#define msleep(x)
+
+struct pci_dev {
+    UInt16 vendor;
+    UInt16 device;
+    UInt16 subsystem_vendor;
+    UInt16 subsystem_device;
+    UInt8 revision;
+};
+
+/* --- fake MMIO --- */
+
+#define kMmioSize       0x2000
+#define kMaxWrites      256
+
+struct MmioWrite {
+    UInt32 reg;
+    UInt32 val;
+};
+
+static UInt32 mmio[kMmioSize / 4];
+static MmioWrite writes[kMaxWrites];
+static int numWrites;
+
+static void mmioReset()
+{
+    memset(mmio, 0xA5, sizeof(mmio));
+    numWrites = 0;
+}
+
+static void mmioWrite(UInt32 reg, UInt32 val)
+{
+    if (numWrites < kMaxWrites) {
+        writes[numWrites].reg = reg;
+        writes[numWrites].val = val;
+    }
+    numWrites++;
+    mmio[(reg % kMmioSize) >> 2] = val;
+}
+
+static UInt32 mmioRead(UInt32 reg)
+{
+    return mmio[(reg % kMmioSize) >> 2];
+}
+
+#define alx_write_mem8(hw, reg, val)
+#define alx_write_mem16(hw, reg, val)
+#define alx_write_mem32(hw, reg, val)   mmioWrite((reg), (val))
+#define alx_read_mem8(hw, reg)          0
+#define alx_read_mem16(hw, reg)         0
+#define alx_read_mem32(hw, reg)         mmioRead(reg)
+#define alx_post_write(hw)
+
+#include "if_ether.h"
+#include "uapi-ethtool.h"
+#include "ethtool.h"
+#include "uapi-mii.h"
+#include "mii.h"
+#include "uapi-mdio.h"
+#include "mdio.h"
+#include "hw.cpp"
+
+static int failures;
+static int checks;
+
+#define CHECK(cond) \
+    do { \
+        checks++; \
+        if (!(cond)) { \
+            failures++; \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+/* Number of writes to reg in the log. */
+static int writesTo(UInt32 reg)
+{
+    int i, n = 0;
+
+    for (i = 0; (i < numWrites) && (i < kMaxWrites); i++) {
+        if (writes[i].reg == reg)
+            n++;
+    }
+    return n;
+}
+
+/* An IPv6 address register quadruple, least significant word first. */
+static bool ipv6Regs(UInt32 reg, UInt32 w3, UInt32 w2, UInt32 w1, UInt32 w0)
+{
+    return ((mmioRead(reg) == w0) && (mmioRead(reg + 4) == w1) &&
+            (mmioRead(reg + 8) == w2) && (mmioRead(reg + 12) == w3));
+}
+
+static const UInt8 ourMAC[6] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55 };
+static const UInt8 ourIPv4[4] = { 192, 168, 1, 10 };
+static const UInt8 otherIPv4[4] = { 192, 168, 1, 11 };
+
+/* fe80::211:22ff:fe33:4455 with the KAME scope id 4 embedded. */
+static const UInt8 linkLocal[16] = {
+    0xfe, 0x80, 0x00, 0x04, 0, 0, 0, 0, 0x02, 0x11, 0x22, 0xff, 0xfe, 0x33, 0x44, 0x55
+};
+
+/* 2001:db8::211:22ff:fe33:4455, same solicited-node group. */
+static const UInt8 globalEui[16] = {
+    0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0x02, 0x11, 0x22, 0xff, 0xfe, 0x33, 0x44, 0x55
+};
+
+/* 2001:db8::10 and 2001:db8::1:10, a second and a third group. */
+static const UInt8 globalShort[16] = {
+    0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x10
+};
+
+static const UInt8 globalThird[16] = {
+    0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0, 0x10
+};
+
+/* fe80::2:1122:ff33:4455, scope id 4, a third target of the first group. */
+static const UInt8 linkLocalThird[16] = {
+    0xfe, 0x80, 0x00, 0x04, 0, 0, 0, 0, 0, 0x02, 0x11, 0x22, 0xff, 0x33, 0x44, 0x55
+};
+
+static void initOffload(struct alx_pmofld *ofld)
+{
+    memset(ofld, 0, sizeof(*ofld));
+    memcpy(ofld->mac, ourMAC, 6);
+    memcpy(ofld->ipv4, ourIPv4, 4);
+    ofld->arp = true;
+}
+
+/* --- address grouping --- */
+
+static void testAddIPv6()
+{
+    struct alx_pmofld ofld;
+
+    initOffload(&ofld);
+    alx_pmofld_add_ipv6(&ofld, linkLocal, true, false);
+    alx_pmofld_add_ipv6(&ofld, globalEui, true, false);
+    alx_pmofld_add_ipv6(&ofld, globalShort, true, false);
+    alx_pmofld_add_ipv6(&ofld, globalThird, true, false);
+    alx_pmofld_add_ipv6(&ofld, linkLocalThird, true, false);
+
+    /* Two groups of which the first one holds both EUI-64 addresses. */
+    CHECK(ofld.num_ns == 2);
+    CHECK(ofld.ns[0].num_tar == 2);
+    CHECK(ofld.ns[1].num_tar == 1);
+
+    /* The scope id is gone from the link-local address. */
+    CHECK((ofld.ns[0].tar[0][2] == 0) && (ofld.ns[0].tar[0][3] == 0));
+    CHECK(!memcmp(&ofld.ns[0].tar[0][4], &linkLocal[4], 12));
+    CHECK(!memcmp(ofld.ns[0].tar[1], globalEui, 16));
+    CHECK(!memcmp(ofld.ns[1].tar[0], globalShort, 16));
+
+    /* Without NS the addresses only matter for the SYN target. */
+    initOffload(&ofld);
+    alx_pmofld_add_ipv6(&ofld, linkLocal, false, true);
+    CHECK(!ofld.syn_v6);
+    alx_pmofld_add_ipv6(&ofld, globalShort, false, true);
+    alx_pmofld_add_ipv6(&ofld, globalEui, false, true);
+    CHECK(ofld.syn_v6);
+    CHECK(!memcmp(ofld.syn_ipv6, globalShort, 16));
+    CHECK(ofld.num_ns == 0);
+}
+
+/* --- register writes --- */
+
+static void testProxyRegs()
+{
+    struct alx_pmofld ofld;
+    struct alx_hw hw;
+    int i;
+
+    memset(&hw, 0, sizeof(hw));
+    initOffload(&ofld);
+    alx_pmofld_add_ipv6(&ofld, linkLocal, true, false);
+    alx_pmofld_add_ipv6(&ofld, globalEui, true, false);
+    alx_pmofld_add_ipv6(&ofld, globalShort, true, false);
+
+    mmioReset();
+    alx_config_pmofld(&hw, &ofld);
+
+    /* ARP replies for 192.168.1.10 to any host. */
+    CHECK(mmioRead(ALX_ARP_REMOTE_IPV4) == 0);
+    CHECK(mmioRead(ALX_ARP_HOST_IPV4) == 0xC0A8010A);
+    CHECK(mmioRead(ALX_ARP_MAC0) == 0x22334455);
+    CHECK(mmioRead(ALX_ARP_MAC1) == 0x00000011);
+
+    /* First engine: ff02::1:ff33:4455 for the link-local and the global EUI-64 address. */
+    CHECK(ipv6Regs(ALX_1ST_REMOTE_IPV6_0, 0, 0, 0, 0));
+    CHECK(ipv6Regs(ALX_1ST_SN_IPV6_0, 0xFF020000, 0, 0x00000001, 0xFF334455));
+    CHECK(ipv6Regs(ALX_1ST_TAR_IPV6_1_0, 0xFE800000, 0, 0x021122FF, 0xFE334455));
+    CHECK(ipv6Regs(ALX_1ST_TAR_IPV6_2_0, 0x20010DB8, 0, 0x021122FF, 0xFE334455));
+    CHECK(mmioRead(ALX_1ST_NS_MAC0) == 0x22334455);
+    CHECK(mmioRead(ALX_1ST_NS_MAC1) == 0x00000011);
+
+    /* Second engine: ff02::1:ff00:10 with one target, the other one cleared. */
+    CHECK(ipv6Regs(ALX_2ND_REMOTE_IPV6_0, 0, 0, 0, 0));
+    CHECK(ipv6Regs(ALX_2ND_SN_IPV6_0, 0xFF020000, 0, 0x00000001, 0xFF000010));
+    CHECK(ipv6Regs(ALX_2ND_TAR_IPV6_1_0, 0x20010DB8, 0, 0, 0x00000010));
+    CHECK(ipv6Regs(ALX_2ND_TAR_IPV6_2_0, 0, 0, 0, 0));
+    CHECK(mmioRead(ALX_2ND_NS_MAC0) == 0x22334455);
+    CHECK(mmioRead(ALX_2ND_NS_MAC1) == 0x00000011);
+
+    /* Enabled for ARP and NS only, the SYN filters stay untouched. */
+    CHECK(mmioRead(ALX_PMOFLD) == (ALX_PMOFLD_ARP_EN | ALX_PMOFLD_NS_EN | ALX_PMOFLD_BY_HW));
+    CHECK(writesTo(ALX_SYNC_IPV4_DA) == 0);
+    CHECK(writesTo(ALX_SYNC_IPV6_DA0) == 0);
+    CHECK(writesTo(ALX_SYNC_V4PORT) == 0);
+    CHECK(writesTo(ALX_SYNC_V6PORT) == 0);
+
+    /* Every register is written once, PMOFLD last. */
+    CHECK(numWrites == 4 + 2 * (4 + 4 + 8 + 2) + 1);
+
+    for (i = 0; i < numWrites; i++)
+        CHECK(writesTo(writes[i].reg) == 1);
+
+    CHECK(writes[numWrites - 1].reg == ALX_PMOFLD);
+}
+
+static void testProxyOff()
+{
+    struct alx_pmofld ofld;
+    struct alx_hw hw;
+
+    memset(&hw, 0, sizeof(hw));
+
+    /* Without parameters the engine is switched off. */
+    mmioReset();
+    alx_config_pmofld(&hw, NULL);
+    CHECK(numWrites == 1);
+    CHECK((writes[0].reg == ALX_PMOFLD) && (writes[0].val == 0));
+
+    /* As it is without anything to offload. */
+    memset(&ofld, 0, sizeof(ofld));
+    mmioReset();
+    alx_config_pmofld(&hw, &ofld);
+    CHECK(numWrites == 1);
+    CHECK(mmioRead(ALX_PMOFLD) == 0);
+}
+
+/* --- SYN wake --- */
+
+/* Offsets into an untagged frame, IPv4 headers are free of options. */
+#define kOffEtherType   12
+#define kOffIPv4Proto   23
+#define kOffIPv4Src     26
+#define kOffIPv4Dst     30
+#define kOffIPv4L4      34
+#define kOffIPv6Next    20
+#define kOffIPv6Src     22
+#define kOffIPv6Dst     38
+#define kOffIPv6L4      54
+
+/* Build a minimal untagged TCP frame from a remote host, returns its length. */
+static UInt32 frameTCPv4(UInt8 *frame, const UInt8 *dst, UInt16 port, UInt8 flags)
+{
+    UInt8 *l4 = &frame[kOffIPv4L4];
+
+    memset(frame, 0, 128);
+    memcpy(frame, ourMAC, 6);
+    frame[kOffEtherType] = 0x08;
+    frame[kOffEtherType + 1] = 0x00;
+    frame[14] = 0x45;
+    frame[kOffIPv4Proto] = 6;
+    frame[kOffIPv4Src] = 10;
+    frame[kOffIPv4Src + 3] = 1;
+    memcpy(&frame[kOffIPv4Dst], dst, 4);
+    l4[0] = 0xC0;
+    l4[1] = 0x01;
+    l4[2] = (UInt8)(port >> 8);
+    l4[3] = (UInt8)port;
+    l4[12] = 0x50;
+    l4[13] = flags;
+
+    return 128;
+}
+
+static UInt32 frameTCPv6(UInt8 *frame, const UInt8 *dst, UInt16 port, UInt8 flags)
+{
+    UInt8 *l4 = &frame[kOffIPv6L4];
+
+    memset(frame, 0, 128);
+    memcpy(frame, ourMAC, 6);
+    frame[kOffEtherType] = 0x86;
+    frame[kOffEtherType + 1] = 0xDD;
+    frame[14] = 0x60;
+    frame[kOffIPv6Next] = 6;
+    frame[kOffIPv6Src] = 0x20;
+    frame[kOffIPv6Src + 15] = 1;
+    memcpy(&frame[kOffIPv6Dst], dst, 16);
+    l4[0] = 0xC0;
+    l4[1] = 0x01;
+    l4[2] = (UInt8)(port >> 8);
+    l4[3] = (UInt8)port;
+    l4[12] = 0x50;
+    l4[13] = flags;
+
+    return 128;
+}
+
+/* A register value of 0 matches anything. */
+static bool regMatches(UInt32 reg, UInt32 val)
+{
+    UInt32 r = mmioRead(reg);
+
+    return (!r || (r == val));
+}
+
+static bool portsMatch(UInt32 reg, const UInt8 *l4)
+{
+    UInt32 r = mmioRead(reg);
+    UInt32 src = ((UInt32)l4[0] << 8) | l4[1];
+    UInt32 dst = ((UInt32)l4[2] << 8) | l4[3];
+
+    return ((((r >> ALX_SYNC_V4PORT_DST_SHIFT) & ALX_SYNC_V4PORT_DST_MASK) == dst) &&
+            (!(r & ALX_SYNC_V4PORT_SRC_MASK) || ((r & ALX_SYNC_V4PORT_SRC_MASK) == src)));
+}
+
+/* Does the SYN filter as programmed into the registers wake us? */
+static bool synWakes(const UInt8 *frame, UInt32 len)
+{
+    UInt32 pmofld = mmioRead(ALX_PMOFLD);
+    const UInt8 *l4;
+    int i;
+
+    if (!(pmofld & ALX_PMOFLD_BY_HW) || (len < kOffIPv6L4 + 20))
+        return false;
+
+    if ((frame[kOffEtherType] == 0x08) && (frame[kOffEtherType + 1] == 0x00)) {
+        l4 = &frame[kOffIPv4L4];
+
+        if (!(pmofld & ALX_PMOFLD_SYNCV4_EN) || (frame[kOffIPv4Proto] != 6) ||
+            (mmioRead(ALX_SYNC_IPV4_DA) != alx_get_be32(&frame[kOffIPv4Dst])) ||
+            !regMatches(ALX_SYNC_IPV4_SA, alx_get_be32(&frame[kOffIPv4Src])) ||
+            !portsMatch(ALX_SYNC_V4PORT, l4))
+            return false;
+    } else if ((frame[kOffEtherType] == 0x86) && (frame[kOffEtherType + 1] == 0xDD)) {
+        l4 = &frame[kOffIPv6L4];
+
+        if (!(pmofld & ALX_PMOFLD_SYNCV6_EN) || (frame[kOffIPv6Next] != 6) ||
+            !portsMatch(ALX_SYNC_V6PORT, l4))
+            return false;
+
+        for (i = 0; i < 4; i++) {
+            if ((mmioRead(ALX_SYNC_IPV6_DA0 + (i << 2)) != alx_get_ipv6_word(&frame[kOffIPv6Dst], i)) ||
+                !regMatches(ALX_SYNC_IPV6_SA0 + (i << 2), alx_get_ipv6_word(&frame[kOffIPv6Src], i)))
+                return false;
+        }
+    } else {
+        return false;
+    }
+    /* SYN set, ACK, RST and FIN clear */
+    return ((l4[13] & 0x17) == 0x02);
+}
+
+static void testSynRegs()
+{
+    struct alx_pmofld ofld;
+    struct alx_pmofld_syn syn;
+    struct alx_hw hw;
+    UInt32 en;
+
+    memset(&hw, 0, sizeof(hw));
+    memset(&ofld, 0, sizeof(ofld));
+    memcpy(ofld.ipv4, ourIPv4, 4);
+    ofld.syn_port = 22;
+    ofld.syn_v4 = true;
+    alx_pmofld_add_ipv6(&ofld, linkLocal, false, true);
+    alx_pmofld_add_ipv6(&ofld, globalShort, false, true);
+
+    /* Our addresses and port 22, any remote host and port. */
+    en = alx_pmofld_syn_regs(&ofld, &syn);
+    CHECK(en == (ALX_PMOFLD_SYNCV4_EN | ALX_PMOFLD_SYNCV6_EN));
+    CHECK(syn.ipv4_sa == 0);
+    CHECK(syn.ipv4_da == 0xC0A8010A);
+    CHECK(syn.v4port == 0x00160000);
+    CHECK(!syn.ipv6_sa[0] && !syn.ipv6_sa[1] && !syn.ipv6_sa[2] && !syn.ipv6_sa[3]);
+    CHECK((syn.ipv6_da[0] == 0x00000010) && (syn.ipv6_da[1] == 0) &&
+          (syn.ipv6_da[2] == 0) && (syn.ipv6_da[3] == 0x20010DB8));
+    CHECK(syn.v6port == 0x00160000);
+
+    /* Which end up in the registers, each written once. */
+    mmioReset();
+    alx_config_pmofld(&hw, &ofld);
+    CHECK(mmioRead(ALX_PMOFLD) == (ALX_PMOFLD_SYNCV4_EN | ALX_PMOFLD_SYNCV6_EN | ALX_PMOFLD_BY_HW));
+    CHECK(mmioRead(ALX_SYNC_IPV4_SA) == 0);
+    CHECK(mmioRead(ALX_SYNC_IPV4_DA) == 0xC0A8010A);
+    CHECK(mmioRead(ALX_SYNC_V4PORT) == 0x00160000);
+    CHECK(ipv6Regs(ALX_SYNC_IPV6_SA0, 0, 0, 0, 0));
+    CHECK(ipv6Regs(ALX_SYNC_IPV6_DA0, 0x20010DB8, 0, 0, 0x00000010));
+    CHECK(mmioRead(ALX_SYNC_V6PORT) == 0x00160000);
+    CHECK(numWrites == 3 + 4 + 4 + 1 + 1);
+    CHECK(writes[numWrites - 1].reg == ALX_PMOFLD);
+
+    /* Without an IPv6 address only the IPv4 filter is set up. */
+    ofld.syn_v6 = false;
+    CHECK(alx_pmofld_syn_regs(&ofld, &syn) == ALX_PMOFLD_SYNCV4_EN);
+    CHECK(syn.v6port == 0);
+
+    mmioReset();
+    alx_config_pmofld(&hw, &ofld);
+    CHECK(writesTo(ALX_SYNC_IPV6_DA0) == 0);
+    CHECK(writesTo(ALX_SYNC_V6PORT) == 0);
+}
+
+static void testSynWake()
+{
+    struct alx_pmofld ofld;
+    struct alx_hw hw;
+    UInt8 frame[128];
+    UInt32 len;
+
+    memset(&hw, 0, sizeof(hw));
+    memset(&ofld, 0, sizeof(ofld));
+    memcpy(ofld.ipv4, ourIPv4, 4);
+    ofld.syn_port = 22;
+    ofld.syn_v4 = true;
+    alx_pmofld_add_ipv6(&ofld, globalShort, false, true);
+
+    mmioReset();
+    alx_config_pmofld(&hw, &ofld);
+
+    /* Connection requests to our service wake us, ECN setup SYNs included. */
+    len = frameTCPv4(frame, ourIPv4, 22, 0x02);
+    CHECK(synWakes(frame, len));
+    len = frameTCPv4(frame, ourIPv4, 22, 0xC2);
+    CHECK(synWakes(frame, len));
+    len = frameTCPv6(frame, globalShort, 22, 0x02);
+    CHECK(synWakes(frame, len));
+
+    /* Traffic of established connections doesn't. */
+    len = frameTCPv4(frame, ourIPv4, 22, 0x10);
+    CHECK(!synWakes(frame, len));
+    len = frameTCPv4(frame, ourIPv4, 22, 0x12);
+    CHECK(!synWakes(frame, len));
+    len = frameTCPv6(frame, globalShort, 22, 0x04);
+    CHECK(!synWakes(frame, len));
+
+    /* Neither do requests to other hosts. */
+    len = frameTCPv4(frame, otherIPv4, 22, 0x02);
+    CHECK(!synWakes(frame, len));
+    len = frameTCPv6(frame, globalEui, 22, 0x02);
+    CHECK(!synWakes(frame, len));
+
+    /* Nor do requests to other ports, additional synWakePorts included. */
+    len = frameTCPv4(frame, ourIPv4, 8080, 0x02);
+    CHECK(!synWakes(frame, len));
+    len = frameTCPv6(frame, globalShort, 8080, 0x02);
+    CHECK(!synWakes(frame, len));
+
+    /* After wakeup the filter is switched off. */
+    alx_config_pmofld(&hw, NULL);
+    len = frameTCPv4(frame, ourIPv4, 22, 0x02);
+    CHECK(!synWakes(frame, len));
+}
+
+int main()
+{
+    testAddIPv6();
+    testProxyRegs();
+    testProxyOff();
+    testSynRegs();
+    testSynWake();
+
+    printf("%d checks, %d failures\n", checks, failures);
+
+    return (failures != 0);
+}
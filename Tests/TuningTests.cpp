@@ -0,0 +1,801 @@
+/* TuningTests.cpp -- Host tests of the driver's self-contained helpers.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Build and run on the host, e.g. on Linux:
+ *
+ *   c++ -std=c++98 -Wall -I../AtherosE2200Ethernet -o TuningTests TuningTests.cpp
+ *   ./TuningTests
+ *
+ * The program returns 0 in case all checks passed.
+ *
+ * Not measured here:
+ * - The per-chip table: the rx and tx loops don't test any chip field,
+ *   so there is no datapath branch whose removal could be benchmarked.
+ * - Ring size sweeps: drops and latency depend on how fast the NIC fills
+ *   the ring versus how fast the work loop drains it, which only shows on
+ *   the hardware under real traffic.
+ * - Cached versus uncached descriptor rings: a user process can't map
+ *   uncached memory without a kernel driver, so only the cached half of
+ *   the comparison could run here.
+ * - The time rxInterrupt() spends per jumbo frame: it is dominated by the
+ *   mbuf allocations of replacePacket(), which only exist in the kernel.
+ *   The ring efficiency it depends on is checked below.
+ * - Tx copy-break versus mapping: the mapping side goes through the mbuf
+ *   cursor and the deferred free in txInterrupt(), neither of which can
+ *   run outside the kernel, and timing the copy alone says nothing.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint64_t UInt64;
+typedef int64_t SInt64;
+typedef uint32_t UInt32;
+typedef int32_t SInt32;
+typedef uint16_t UInt16;
+typedef uint8_t UInt8;
+
+#include "AtherosE2200Tuning.h"
+
+static int failures;
+static int checks;
+
+#define CHECK(cond) \
+    do { \
+        checks++; \
+        if (!(cond)) { \
+            failures++; \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+/* --- poll controller --- */
+
+/* Same members as IONetworkPacketPollingParameters. */
+struct PollParams {
+    UInt32 lowThresholdPackets;
+    UInt32 highThresholdPackets;
+    UInt32 lowThresholdBytes;
+    UInt32 highThresholdBytes;
+    UInt64 pollIntervalTime;
+};
+
+/* The 1000 Mbit/s starting values of setLinkUp(). */
+static void initPollParams(PollParams *params)
+{
+    params->lowThresholdPackets = 10;
+    params->highThresholdPackets = 40;
+    params->lowThresholdBytes = 0x1000;
+    params->highThresholdBytes = 0x10000;
+    params->pollIntervalTime = 170000;
+}
+
+static QCAPollStats pollPattern(UInt32 polls, UInt32 empty, UInt32 full)
+{
+    QCAPollStats stats;
+
+    stats.polls = polls;
+    stats.emptyPolls = empty;
+    stats.fullPolls = full;
+
+    return stats;
+}
+
+static void testPollIdle()
+{
+    PollParams params;
+    QCAPollStats stats = pollPattern(100, 90, 0);
+    int i;
+
+    initPollParams(&params);
+
+    /* Light traffic stretches the interval and raises the thresholds. */
+    CHECK(tunePollParams(&params, &stats, 64));
+    CHECK(params.pollIntervalTime == 340000);
+    CHECK(params.lowThresholdPackets == 15);
+
+    for (i = 0; i < 20; i++)
+        tunePollParams(&params, &stats, 64);
+
+    /* Both end up at their upper limits and stay there. */
+    CHECK(params.pollIntervalTime == kPollIntervalMax);
+    CHECK(params.lowThresholdPackets == kPollThresholdMax);
+    CHECK(params.highThresholdPackets == kPollThresholdMax * kPollPacketRatio);
+    CHECK(!tunePollParams(&params, &stats, 64));
+}
+
+static void testPollSaturated()
+{
+    PollParams params;
+    QCAPollStats stats = pollPattern(1000, 0, 500);
+    int i;
+
+    initPollParams(&params);
+
+    /* Full batches shorten the interval down to the lower limit. */
+    CHECK(tunePollParams(&params, &stats, 1500));
+    CHECK(params.pollIntervalTime == 85000);
+
+    for (i = 0; i < 10; i++)
+        tunePollParams(&params, &stats, 1500);
+
+    CHECK(params.pollIntervalTime == kPollIntervalMin);
+    CHECK(params.lowThresholdPackets == 10);
+}
+
+static void testPollSteady()
+{
+    PollParams params;
+    QCAPollStats stats = pollPattern(1000, 50, 10);
+    int i;
+
+    initPollParams(&params);
+
+    /* Neither mostly empty nor full: the thresholds drift back down. */
+    for (i = 0; i < 20; i++)
+        tunePollParams(&params, &stats, 512);
+
+    CHECK(params.pollIntervalTime == 170000);
+    CHECK(params.lowThresholdPackets == kPollThresholdMin);
+}
+
+static void testPollBursty()
+{
+    PollParams params;
+    QCAPollStats idle = pollPattern(100, 95, 0);
+    QCAPollStats burst = pollPattern(1000, 0, 800);
+    int i;
+
+    initPollParams(&params);
+
+    /* Alternating idle and burst periods never leave the limits. */
+    for (i = 0; i < 50; i++) {
+        tunePollParams(&params, (i & 1) ? &burst : &idle, (i & 1) ? 1500 : 64);
+
+        CHECK(params.pollIntervalTime >= kPollIntervalMin);
+        CHECK(params.pollIntervalTime <= kPollIntervalMax);
+        CHECK(params.lowThresholdPackets >= kPollThresholdMin);
+        CHECK(params.lowThresholdPackets <= kPollThresholdMax);
+        CHECK(params.highThresholdPackets == params.lowThresholdPackets * kPollPacketRatio);
+    }
+}
+
+static void testPollBytes()
+{
+    PollParams params;
+    QCAPollStats stats = pollPattern(0, 0, 0);
+
+    initPollParams(&params);
+
+    /* The byte thresholds are the packet thresholds scaled by the frame size. */
+    CHECK(tunePollParams(&params, &stats, 1500));
+    CHECK(params.lowThresholdBytes == 10 * 1500);
+    CHECK(params.highThresholdBytes == 10 * 1500 * kPollByteRatio);
+
+    /* Without a frame size the byte thresholds are left alone. */
+    initPollParams(&params);
+    CHECK(!tunePollParams(&params, &stats, 0));
+    CHECK(params.lowThresholdBytes == 0x1000);
+    CHECK(params.highThresholdBytes == 0x10000);
+}
+
+/* --- tx pacing --- */
+
+#define kPaceWireRate   125     /* bytes per microsecond at 1000 Mbit/s */
+#define kPaceRingBytes  262144  /* what the byte queue limit lets into the ring */
+#define kPaceFrameLen   65536
+#define kPaceBuckets    5
+
+/* Frames released by one outputStart() run, counted in 1, 2, 3-4, 5-8 and 9+. */
+struct PaceSim {
+    UInt32 runs[kPaceBuckets];
+    UInt32 maxBurst;
+    UInt64 sent;
+};
+
+static UInt32 paceBucket(UInt32 frames)
+{
+    if (frames <= 2)
+        return frames - 1;
+    if (frames <= 4)
+        return 2;
+    if (frames <= 8)
+        return 3;
+
+    return 4;
+}
+
+/*
+ * Model outputStart() in steps of 1us: every 10ms the stack queues 16 TSO
+ * frames, up to 64, and the wire drains the ring at 1000 Mbit/s. Without
+ * a rate each run fills the ring, with one it follows txPaceRefill().
+ */
+static void simulatePacing(UInt32 rate, UInt64 duration, PaceSim *sim)
+{
+    SInt64 tokens = kTxPaceBurst;
+    UInt64 stamp = 0;
+    UInt64 wake = 0;
+    UInt64 now;
+    UInt32 inFlight = 0;
+    UInt32 queued = 0;
+    UInt32 frames;
+
+    memset(sim, 0, sizeof(*sim));
+
+    for (now = 0; now < duration; now++) {
+        if ((now % 10000) == 0)
+            queued = (queued + 16 > 64) ? 64 : queued + 16;
+
+        inFlight -= (inFlight > kPaceWireRate) ? kPaceWireRate : inFlight;
+
+        if (now < wake)
+            continue;
+
+        frames = 0;
+
+        while (queued && (inFlight + kPaceFrameLen <= kPaceRingBytes)) {
+            if (rate && (tokens <= 0)) {
+                bool credit = txPaceCredit(&tokens, (now - stamp) * 1000, rate);
+
+                stamp = now;
+
+                if (!credit) {
+                    wake = now + txPaceDelay(tokens, rate);
+                    break;
+                }
+            }
+            txPaceDebit(&tokens, kPaceFrameLen);
+            inFlight += kPaceFrameLen;
+            queued--;
+            frames++;
+        }
+        if (frames) {
+            sim->runs[paceBucket(frames)]++;
+            sim->sent += (UInt64)frames * kPaceFrameLen;
+
+            if (frames * kPaceFrameLen > sim->maxBurst)
+                sim->maxBurst = frames * kPaceFrameLen;
+        }
+    }
+}
+
+static void printPacing(const char *name, const PaceSim *sim)
+{
+    printf("%s: runs releasing 1/2/3-4/5-8/9+ frames: %u/%u/%u/%u/%u, max burst %u bytes\n",
+           name, sim->runs[0], sim->runs[1], sim->runs[2], sim->runs[3], sim->runs[4], sim->maxBurst);
+}
+
+static void testPaceCredit()
+{
+    SInt64 tokens = 0;
+
+    /* 8 Mbit/s is one byte per microsecond. */
+    CHECK(txPaceCredit(&tokens, 1000, 8));
+    CHECK(tokens == 1);
+
+    /* The credit never exceeds one burst. */
+    CHECK(txPaceCredit(&tokens, 1000000000ULL, 1000));
+    CHECK(tokens == kTxPaceBurst);
+
+    /* The debt is paid back in the time it takes to send it, plus 1us. */
+    tokens = 0;
+    txPaceDebit(&tokens, 1000);
+    CHECK(!txPaceCredit(&tokens, 999000, 8));
+    CHECK(tokens == -1);
+    CHECK(txPaceDelay(tokens, 8) == 2);
+    CHECK(txPaceDelay(-65536, 1000) == 525);
+}
+
+static void testPaceBursts()
+{
+    PaceSim unpaced, paced;
+    UInt32 i;
+
+    simulatePacing(0, 1000000, &unpaced);
+    simulatePacing(400, 1000000, &paced);
+    printPacing("unpaced", &unpaced);
+    printPacing("paced at 400 Mbit/s", &paced);
+
+    /* Without pacing each burst of the stack fills the ring at once. */
+    CHECK(unpaced.maxBurst == kPaceRingBytes);
+    CHECK(unpaced.runs[2] == 100);
+    CHECK(unpaced.sent == 100ULL * 16 * kPaceFrameLen);
+
+    /* The pacer never releases more than its burst. */
+    CHECK(paced.maxBurst <= kTxPaceBurst);
+
+    for (i = 2; i < kPaceBuckets; i++)
+        CHECK(paced.runs[i] == 0);
+
+    /* And holds the rate over a second, apart from the initial burst and the last frame's debt. */
+    CHECK(paced.sent <= 50000000ULL + kTxPaceBurst + kPaceFrameLen);
+    CHECK(paced.sent >= 50000000ULL - kTxPaceBurst);
+}
+
+/* --- descriptor arena --- */
+
+/* The ring layout of setupDescArena(): tx, rx return and rx free. */
+static UInt64 arenaSize(UInt32 numTx, UInt32 numRx, QCADescRange *ranges)
+{
+    ranges[0].size = numTx * 16;
+    ranges[0].align = 256;
+    ranges[1].size = numRx * 16;
+    ranges[1].align = 4096;
+    ranges[2].size = numRx * 8;
+    ranges[2].align = 8;
+
+    return descArenaLayoutSize(ranges, 3);
+}
+
+static void testDescAlign()
+{
+    CHECK(descAlign(0, 4096) == 0);
+    CHECK(descAlign(1, 4096) == 4096);
+    CHECK(descAlign(4096, 4096) == 4096);
+    CHECK(descAlign(4097, 8) == 4104);
+    CHECK(descAlign(0xFFFFFFFFULL, 256) == 0x100000000ULL);
+}
+
+static void testDescArenaLayout()
+{
+    QCADescRange ranges[3];
+    UInt64 size, used, start;
+    UInt32 numTx, numRx, i;
+
+    /* The smallest rings: the rx return ring starts on the next page. */
+    size = arenaSize(256, 64, ranges);
+    CHECK(size == 4096 + 1024 + 512);
+
+    /* All rings of every supported size fit in order and exactly. */
+    for (numTx = 256; numTx <= 4096; numTx <<= 1) {
+        for (numRx = 64; numRx <= 4096; numRx <<= 1) {
+            size = arenaSize(numTx, numRx, ranges);
+            used = 0;
+
+            for (i = 0; i < 3; i++) {
+                CHECK(descRangeFit(used, ranges[i].size, ranges[i].align, size, &start));
+                CHECK((start & (ranges[i].align - 1)) == 0);
+                CHECK(start >= used);
+                used = start + ranges[i].size;
+            }
+            CHECK(used == size);
+            CHECK(!descRangeFit(used, 1, 1, size, &start));
+        }
+    }
+    /* Odd sizes still respect the alignment of the next range. */
+    ranges[0].size = 100;
+    ranges[0].align = 256;
+    ranges[1].size = 10;
+    ranges[1].align = 4096;
+    ranges[2].size = 3;
+    ranges[2].align = 8;
+    CHECK(descArenaLayoutSize(ranges, 3) == 4096 + 16 + 3);
+}
+
+static void testDescRangeFit()
+{
+    UInt64 start = 0;
+
+    CHECK(descRangeFit(0, 4096, 4096, 4096, &start) && (start == 0));
+    CHECK(descRangeFit(1, 4096, 4096, 8192, &start) && (start == 4096));
+    CHECK(!descRangeFit(1, 4096, 4096, 8191, &start));
+
+    /* Alignment padding beyond the end and huge sizes don't wrap around. */
+    CHECK(!descRangeFit(4000, 0, 4096, 4095, &start));
+    CHECK(!descRangeFit(4096, ~0ULL, 8, 8192, &start));
+}
+
+static void testDescArena4GB()
+{
+    CHECK(!descArenaCrosses4GB(0xFFFFF000ULL, 0x1000));
+    CHECK(descArenaCrosses4GB(0xFFFFF000ULL, 0x1001));
+    CHECK(!descArenaCrosses4GB(0x100000000ULL, 0x10000));
+    CHECK(descArenaCrosses4GB(0x1FFFFF000ULL, 0x2000));
+    CHECK(!descArenaCrosses4GB(0xFFFFFFFFULL, 0));
+    CHECK(!descArenaCrosses4GB(0, 0x100000000ULL));
+    CHECK(descArenaCrosses4GB(0, 0x100000001ULL));
+}
+
+/* --- rx buffers --- */
+
+/* RFD slots a received frame of maxSize bytes plus a vlan tag takes. */
+static UInt32 rxSlots(UInt32 maxSize, UInt32 bufSize)
+{
+    return (maxSize + 4 + bufSize - 1) / bufSize;
+}
+
+static void testRxBufferSize()
+{
+    CHECK(rxBufferSizeFor(1518) == kRxBufferPktSize);
+    CHECK(rxBufferSizeFor(2044) == kRxBufferPktSize);
+    CHECK(rxBufferSizeFor(2045) == kRxJumboBufSize);
+    CHECK(rxBufferSizeFor(9018) == kRxJumboBufSize);
+}
+
+/*
+ * Ring efficiency at MTU 9000: every slot of a frame costs a buffer
+ * replacement and a physical segment lookup in rxInterrupt().
+ */
+static void testRxJumboRing()
+{
+    UInt32 maxSize = 9000 + 18;
+    UInt32 chained = rxSlots(maxSize, kRxBufferPktSize);
+    UInt32 jumbo = rxSlots(maxSize, rxBufferSizeFor(maxSize));
+    UInt32 numRx;
+
+    printf("MTU 9000: %u slots per frame with %u byte buffers, %u with %u byte buffers\n",
+           chained, kRxBufferPktSize, jumbo, rxBufferSizeFor(maxSize));
+
+    CHECK(chained == 5);
+    CHECK(jumbo == 3);
+
+    for (numRx = 64; numRx <= 4096; numRx <<= 1) {
+        printf("  %4u slot ring: %4u frames chained, %4u frames jumbo\n", numRx, numRx / chained, numRx / jumbo);
+        CHECK((numRx / jumbo) > (numRx / chained));
+    }
+    /* A standard frame still fits into one cluster. */
+    CHECK(rxSlots(1518, rxBufferSizeFor(1518)) == 1);
+}
+
+/* --- descriptors --- */
+
+static UInt64 swapBytes(UInt64 x, UInt32 width)
+{
+    UInt64 y = 0;
+    UInt32 i;
+
+    for (i = 0; i < width; i++, x >>= 8)
+        y = (y << 8) | (x & 0xff);
+
+    return y;
+}
+
+/* The OSSwap conversions of a little and a big endian host. */
+struct LittleHost {
+    static const bool big = false;
+    static UInt64 toLE64(UInt64 x) { return x; }
+    static UInt64 fromLE64(UInt64 x) { return x; }
+};
+
+struct BigHost {
+    static const bool big = true;
+    static UInt64 toLE64(UInt64 x) { return swapBytes(x, 8); }
+    static UInt64 fromLE64(UInt64 x) { return swapBytes(x, 8); }
+};
+
+static UInt64 hostToLE(UInt64 x, UInt32 width, bool big)
+{
+    return big ? swapBytes(x, width) : x;
+}
+
+static UInt64 hostToBE(UInt64 x, UInt32 width, bool big)
+{
+    return big ? x : swapBytes(x, width);
+}
+
+/* What a native store of width bytes leaves in memory on the host. */
+static void storeNative(UInt8 *mem, UInt32 width, UInt64 x, bool big)
+{
+    UInt32 i;
+
+    for (i = 0; i < width; i++)
+        mem[big ? (width - 1 - i) : i] = (UInt8)(x >> (8 * i));
+}
+
+static UInt64 loadNative(const UInt8 *mem, UInt32 width, bool big)
+{
+    UInt64 x = 0;
+    UInt32 i;
+
+    for (i = 0; i < width; i++)
+        x |= (UInt64)mem[big ? (width - 1 - i) : i] << (8 * i);
+
+    return x;
+}
+
+/* The field by field stores outputStart() did before. */
+static void oldTxDesc(UInt8 *mem, UInt16 length, UInt16 vlanTag, UInt32 word1, UInt64 addr, bool big)
+{
+    storeNative(mem, 2, hostToLE(length, 2, big), big);
+    storeNative(mem + 2, 2, hostToBE(vlanTag, 2, big), big);
+    storeNative(mem + 4, 4, hostToLE(word1, 4, big), big);
+    storeNative(mem + 8, 8, hostToLE(addr, 8, big), big);
+}
+
+/* The IPv6 context descriptor, which only set vlanTag, word1 and pktLength. */
+static void oldTxContext(UInt8 *mem, UInt16 vlanTag, UInt32 word1, UInt32 pktLength, bool big)
+{
+    storeNative(mem + 2, 2, hostToBE(vlanTag, 2, big), big);
+    storeNative(mem + 4, 4, hostToLE(word1, 4, big), big);
+    storeNative(mem + 8, 4, hostToLE(pktLength, 4, big), big);
+}
+
+template <class B>
+static void newTxDesc(UInt8 *mem, UInt16 length, UInt16 vlanTag, UInt32 word1, UInt64 addr)
+{
+    UInt64 q[2];
+
+    txDescStore<B>(q, length, vlanTag, word1, addr);
+    storeNative(mem, 8, q[0], B::big);
+    storeNative(mem + 8, 8, q[1], B::big);
+}
+
+template <class B>
+static void checkTxDesc()
+{
+    UInt8 oldMem[16], newMem[16];
+
+    memset(oldMem, 0, sizeof(oldMem));
+    oldTxDesc(oldMem, 0x05ea, 0x1234, 0x80004321, 0x123456789abcdef0ULL, B::big);
+    newTxDesc<B>(newMem, 0x05ea, 0x1234, 0x80004321, 0x123456789abcdef0ULL);
+    CHECK(memcmp(oldMem, newMem, 16) == 0);
+
+    /* The bytes the NIC sees: the length and the rest little endian, the vlan tag big endian. */
+    CHECK((newMem[0] == 0xea) && (newMem[1] == 0x05));
+    CHECK((newMem[2] == 0x12) && (newMem[3] == 0x34));
+    CHECK((newMem[4] == 0x21) && (newMem[7] == 0x80));
+    CHECK((newMem[8] == 0xf0) && (newMem[15] == 0x12));
+
+    /* The IPv6 context descriptor of a slot which was clean before. */
+    memset(oldMem, 0, sizeof(oldMem));
+    oldTxContext(oldMem, 0x0fff, 0x00051000, 9014, B::big);
+    newTxDesc<B>(newMem, 0, 0x0fff, 0x00051000, 9014);
+    CHECK(memcmp(oldMem, newMem, 16) == 0);
+
+    /* Of a reused one: the stale length and reserved words are cleared now. */
+    memset(oldMem, 0xa5, sizeof(oldMem));
+    oldTxContext(oldMem, 0x0fff, 0x00051000, 9014, B::big);
+    CHECK(memcmp(oldMem + 2, newMem + 2, 10) == 0);
+    CHECK((oldMem[0] == 0xa5) && (oldMem[12] == 0xa5));
+    CHECK((newMem[0] == 0) && (newMem[1] == 0));
+    CHECK((newMem[12] | newMem[13] | newMem[14] | newMem[15]) == 0);
+}
+
+template <class B>
+static void checkRxDesc()
+{
+    const UInt32 words[4] = { 0x10012345, 0xdeadbeef, 0x00000064, 0x800005ee };
+    UInt8 mem[16];
+    UInt64 q[2];
+    UInt64 status;
+    UInt32 i;
+
+    /* The NIC writes all four words little endian. */
+    for (i = 0; i < 4; i++)
+        storeNative(mem + (4 * i), 4, words[i], false);
+
+    /* A native quadword load of the same memory. */
+    q[0] = loadNative(mem, 8, B::big);
+    q[1] = loadNative(mem + 8, 8, B::big);
+
+    status = rxDescLoad<B>(q, 1);
+    CHECK((UInt32)status == (UInt32)hostToLE(loadNative(mem + 8, 4, B::big), 4, B::big));
+    CHECK((UInt32)(status >> 32) == (UInt32)hostToLE(loadNative(mem + 12, 4, B::big), 4, B::big));
+    CHECK((UInt32)status == words[2]);
+    CHECK((UInt32)(status >> 32) == words[3]);
+
+    status = rxDescLoad<B>(q, 0);
+    CHECK((UInt32)status == words[0]);
+    CHECK((UInt32)(status >> 32) == words[1]);
+}
+
+static void testDescStoreLoad()
+{
+    checkTxDesc<LittleHost>();
+    checkTxDesc<BigHost>();
+    checkRxDesc<LittleHost>();
+    checkRxDesc<BigHost>();
+}
+
+/* --- tx descriptor streams --- */
+
+#define kTestRingSize   16
+#define kTestEop        (1U << 31)
+#define kTestBounce     0x80000000ULL
+
+struct TestSeg {
+    UInt64 location;
+    UInt32 length;
+};
+
+struct TestRing {
+    UInt64 desc[2 * kTestRingSize];
+    const char *mbufs[kTestRingSize];
+};
+
+static const char testMbuf[] = "mbuf";
+
+static void initRing(TestRing *ring)
+{
+    UInt32 i;
+
+    for (i = 0; i < 2 * kTestRingSize; i++)
+        ring->desc[i] = 0x5a5a5a5a5a5a5a5aULL;
+
+    for (i = 0; i < kTestRingSize; i++)
+        ring->mbufs[i] = testMbuf + 1;
+}
+
+static UInt16 tpdLength(const TestRing *ring, UInt32 index)
+{
+    return (UInt16)ring->desc[2 * index];
+}
+
+static UInt32 tpdWord1(const TestRing *ring, UInt32 index)
+{
+    return (UInt32)(ring->desc[2 * index] >> 32);
+}
+
+/* The descriptor stream outputStart() emitted before, slot for slot. */
+static UInt32 oldEmitPacket(TestRing *ring, UInt32 index, const QCATxPacket *pkt, const TestSeg *segs, UInt32 numSegs)
+{
+    const UInt32 mask = kTestRingSize - 1;
+    UInt32 numDescs = numSegs + (pkt->ctxLen ? 1 : 0) + (pkt->hdrLen ? 1 : 0);
+    UInt32 i;
+
+    if (pkt->ctxLen) {
+        txDescStore<LittleHost>(&ring->desc[2 * index], 0, pkt->vlanTag, pkt->cmd, pkt->ctxLen);
+        ++index &= mask;
+    }
+    if (pkt->hdrLen) {
+        txDescStore<LittleHost>(&ring->desc[2 * index], pkt->hdrLen, pkt->vlanTag, pkt->cmd, kTestBounce + (index * 256));
+        ring->mbufs[index] = NULL;
+        ++index &= mask;
+    }
+    for (i = 0; i < numSegs; i++) {
+        txDescStore<LittleHost>(&ring->desc[2 * index], segs[i].length, pkt->vlanTag,
+                                (i == numSegs - 1) ? (pkt->cmd | kTestEop) : pkt->cmd, segs[i].location);
+        ring->mbufs[index] = (i == numSegs - 1) ? testMbuf : NULL;
+        ++index &= mask;
+    }
+    return numDescs;
+}
+
+static UInt32 newEmitPacket(TestRing *ring, UInt32 index, QCATxPacket *pkt, const TestSeg *segs, UInt32 numSegs, UInt32 *last)
+{
+    /* The header slot outputStart() copies to: behind the IPv6 context. */
+    UInt32 hdrIndex = (index + (pkt->ctxLen ? 1 : 0)) & (kTestRingSize - 1);
+
+    pkt->hdrAddr = kTestBounce + (hdrIndex * 256);
+
+    return txEmitPacket<LittleHost>(ring->desc, ring->mbufs, kTestRingSize - 1, index, pkt, segs, numSegs, testMbuf, kTestEop, last);
+}
+
+static QCATxPacket txPacket(UInt32 hdrLen, UInt32 ctxLen, UInt32 cmd)
+{
+    QCATxPacket pkt;
+
+    pkt.hdrAddr = 0;
+    pkt.hdrLen = hdrLen;
+    pkt.ctxLen = ctxLen;
+    pkt.cmd = cmd;
+    pkt.vlanTag = 0x0064;
+
+    return pkt;
+}
+
+static bool sameStream(const TestSeg *segs, UInt32 numSegs, UInt32 index, UInt32 hdrLen, UInt32 ctxLen, UInt32 cmd)
+{
+    TestRing oldRing, newRing;
+    QCATxPacket pkt = txPacket(hdrLen, ctxLen, cmd);
+    UInt32 oldNum, newNum, last = ~0U;
+
+    initRing(&oldRing);
+    initRing(&newRing);
+    oldNum = oldEmitPacket(&oldRing, index, &pkt, segs, numSegs);
+    newNum = newEmitPacket(&newRing, index, &pkt, segs, numSegs, &last);
+
+    /* The old code left the context slot's mbuf alone, it is NULL after completion. */
+    if (ctxLen)
+        oldRing.mbufs[index] = NULL;
+
+    return ((oldNum == newNum) && (last == ((index + newNum - 1) & (kTestRingSize - 1))) &&
+            !memcmp(oldRing.desc, newRing.desc, sizeof(oldRing.desc)) &&
+            !memcmp(oldRing.mbufs, newRing.mbufs, sizeof(oldRing.mbufs)));
+}
+
+static void testTxStream()
+{
+    const TestSeg segs[4] = {
+        { 0x10000000ULL, 1448 }, { 0x10001000ULL, 4096 }, { 0x20000000ULL, 2896 }, { 0x30000000ULL, 100 }
+    };
+    TestRing ring;
+    QCATxPacket pkt;
+    UInt32 last;
+
+    /* Checksum offload, TSO over IPv4 and IPv6 with and without copied headers. */
+    CHECK(sameStream(segs, 1, 0, 0, 0, 0x00000300));
+    CHECK(sameStream(segs, 3, 5, 0, 0, 0x00000300));
+    CHECK(sameStream(segs, 4, 3, 54, 0, 0x05a81012));
+    CHECK(sameStream(segs, 4, 3, 0, 0, 0x05a81012));
+    CHECK(sameStream(segs, 4, 2, 74, 8614, 0x05a81814));
+    CHECK(sameStream(segs, 4, 2, 0, 8614, 0x05a81814));
+
+    /* Wrapping around the end of the ring. */
+    CHECK(sameStream(segs, 4, 14, 54, 0, 0x05a81012));
+    CHECK(sameStream(segs, 4, 15, 74, 8614, 0x05a81814));
+
+    /* The header TPD sits behind the IPv6 context and points at its own slot. */
+    initRing(&ring);
+    pkt = txPacket(74, 8614, 0x05a81814);
+    CHECK(newEmitPacket(&ring, 15, &pkt, segs, 2, &last) == 4);
+    CHECK((tpdLength(&ring, 15) == 0) && ((UInt32)ring.desc[31] == 8614));
+    CHECK((tpdLength(&ring, 0) == 74) && (ring.desc[1] == kTestBounce));
+    CHECK((tpdLength(&ring, 1) == 1448) && (tpdLength(&ring, 2) == 4096));
+    CHECK((last == 2) && (tpdWord1(&ring, 2) & kTestEop) && !(tpdWord1(&ring, 1) & kTestEop));
+    CHECK((ring.mbufs[2] == testMbuf) && !ring.mbufs[15] && !ring.mbufs[0] && !ring.mbufs[1]);
+}
+
+static void testTxStreamEmptySegs()
+{
+    const TestSeg stripped[3] = { { 0x10000000ULL, 0 }, { 0x10001000ULL, 4096 }, { 0x20000000ULL, 2896 } };
+    const TestSeg tail[3] = { { 0x10000000ULL, 1448 }, { 0x10001000ULL, 4096 }, { 0x20000000ULL, 0 } };
+    const TestSeg empty[2] = { { 0x10000000ULL, 0 }, { 0x20000000ULL, 0 } };
+    TestRing oldRing, newRing;
+    QCATxPacket pkt = txPacket(54, 0, 0x05a81012);
+    UInt32 last = ~0U;
+    UInt32 i;
+
+    /*
+     * mbuf_adj() leaves a zero length first mbuf in case it held nothing
+     * but the headers. The old code emitted a TPD of length 0 for it.
+     */
+    initRing(&oldRing);
+    initRing(&newRing);
+    CHECK(oldEmitPacket(&oldRing, 0, &pkt, stripped, 3) == 4);
+    CHECK(tpdLength(&oldRing, 1) == 0);
+
+    CHECK(newEmitPacket(&newRing, 0, &pkt, stripped, 3, &last) == 3);
+    CHECK(last == 2);
+
+    for (i = 0; i < 3; i++)
+        CHECK(tpdLength(&newRing, i) != 0);
+
+    CHECK((tpdLength(&newRing, 1) == 4096) && (tpdLength(&newRing, 2) == 2896));
+    CHECK(tpdWord1(&newRing, 2) & kTestEop);
+    CHECK(newRing.mbufs[2] == testMbuf);
+
+    /* The slot behind the packet is left alone. */
+    CHECK(newRing.desc[6] == 0x5a5a5a5a5a5a5a5aULL);
+
+    /* A trailing empty segment doesn't take the end of packet mark. */
+    initRing(&newRing);
+    CHECK(newEmitPacket(&newRing, 0, &pkt, tail, 3, &last) == 3);
+    CHECK((last == 2) && (tpdLength(&newRing, 2) == 4096));
+    CHECK(tpdWord1(&newRing, 2) & kTestEop);
+
+    /* Nothing at all to send doesn't touch the ring. */
+    initRing(&newRing);
+    CHECK(newEmitPacket(&newRing, 0, &pkt, empty, 2, &last) == 0);
+    CHECK(newRing.desc[0] == 0x5a5a5a5a5a5a5a5aULL);
+    CHECK(newRing.mbufs[0] == testMbuf + 1);
+}
+
+int main()
+{
+    testPollIdle();
+    testPollSaturated();
+    testPollSteady();
+    testPollBursty();
+    testPollBytes();
+    testPaceCredit();
+    testPaceBursts();
+    testDescAlign();
+    testDescArenaLayout();
+    testDescRangeFit();
+    testDescArena4GB();
+    testDescStoreLoad();
+    testRxBufferSize();
+    testRxJumboRing();
+    testTxStream();
+    testTxStreamEmptySegs();
+
+    printf("%d checks, %d failures\n", checks, failures);
+
+    return (failures != 0);
+}